@@ -1,3 +1,8 @@
 #!/bin/sh
 
-gcc test_controlled.c cb_tree.c -o test_controlled -lpthread
+gcc test_controlled.c cb_tree.c cb_traverse.c cb_shape.c -o test_controlled -lpthread
+gcc -DCOUNTS_ON test_controlled.c cb_tree.c cb_traverse.c cb_shape.c -o test_controlled_counts -lpthread
+gcc test_wal.c cb_tree.c cb_wal.c -o test_wal -lpthread
+g++ test_map.cpp -x c cb_tree.c -o test_map -lpthread
+gcc test_split.c cb_tree.c cb_traverse.c -o test_split -lpthread
+gcc -DCOUNTS_ON test_split.c cb_tree.c cb_traverse.c -o test_split_counts -lpthread
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cb_shape.h"
+#include "cb_traverse.h"
+
+static void cb_shape_leaf(cb_leaf *leaf, int depth, void *acc){
+	cb_shape *s = (cb_shape*)acc;
+	s->leafs++;
+	s->depth[depth]++;
+	s->depth_sum += depth;
+	if(depth > s->max_depth) s->max_depth = depth;
+}
+
+static void cb_shape_branch(void *node, int depth, void *acc){
+	cb_shape *s = (cb_shape*)acc;
+	if(((cb_branch*)node)->type == TYPE_BRANCH){
+		cb_branch *branch = (cb_branch*)node;
+		s->branches++;
+		s->crit_byte[branch->byte]++;
+		s->crit_bit[__builtin_ctz(branch->bitmask)]++;
+	}
+	else{
+		cb_nibble *nibble = (cb_nibble*)node;
+		s->nibbles++;
+		s->crit_byte[nibble->byte]++;
+		s->nibble_sons[nibble->count]++;
+	}
+}
+
+static void cb_shape_combine(void *acc, void *part){
+	cb_shape *s = (cb_shape*)acc, *p = (cb_shape*)part;
+	int i;
+	s->leafs += p->leafs;
+	s->branches += p->branches;
+	s->nibbles += p->nibbles;
+	for(i = 0; i <= MAX_DEPTH; i++)
+		s->depth[i] += p->depth[i];
+	s->depth_sum += p->depth_sum;
+	if(p->max_depth > s->max_depth) s->max_depth = p->max_depth;
+	for(i = 0; i < KEYLEN; i++)
+		s->crit_byte[i] += p->crit_byte[i];
+	for(i = 0; i < 8; i++)
+		s->crit_bit[i] += p->crit_bit[i];
+	for(i = 0; i <= 16; i++)
+		s->nibble_sons[i] += p->nibble_sons[i];
+}
+
+int cb_shape_stats(void *p, int nthreads, cb_shape *s){
+	cb_visitor v = {&cb_shape_leaf, &cb_shape_branch, &cb_shape_combine, sizeof(cb_shape)};
+	memset(s, 0, sizeof(cb_shape));
+	if(cb_traverse(p, nthreads, &v, s) == FAIL) return FAIL;
+	s->avg_depth = s->leafs ? (double)s->depth_sum / s->leafs : 0;
+	s->leaf_bytes = s->leafs * sizeof(cb_leaf);
+	s->branch_bytes = s->branches * sizeof(cb_branch);
+	s->nibble_bytes = s->nibbles * sizeof(cb_nibble);
+	return SUCCESS;
+}
+
+void cb_shape_print(cb_shape *s, FILE *f){
+	int i;
+	fprintf(f, "%lu leafs (%lu bytes), %lu branches (%lu bytes), %lu nibble nodes (%lu bytes)\n", s->leafs, s->leaf_bytes, s->branches, s->branch_bytes, s->nibbles, s->nibble_bytes);
+	fprintf(f, "average depth %.2f, maximum depth %u\n", s->avg_depth, s->max_depth);
+	fprintf(f, "leafs per depth:");
+	for(i = 0; i <= s->max_depth; i++)
+		fprintf(f, " %lu", s->depth[i]);
+	fprintf(f, "\nbranch and nibble nodes per critical byte:");
+	for(i = 0; i < KEYLEN; i++)
+		fprintf(f, " %lu", s->crit_byte[i]);
+	fprintf(f, "\nbranches per critical bit:");
+	for(i = 0; i < 8; i++)
+		fprintf(f, " %lu", s->crit_bit[i]);
+	fprintf(f, "\nnibble nodes per number of sons:\n");
+	for(i = 2; i <= 16; i++)
+		fprintf(f, "%2d sons: %lu\n", i, s->nibble_sons[i]);
+	fflush(f);
+}
@@ -0,0 +1,36 @@
+#ifndef CB_SHAPE_H
+#define CB_SHAPE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "cb_tree.h"
+
+#define MAX_DEPTH (KEYLEN*8)	// a path never tests the same bit twice
+
+// shape of a tree (or subtree), including the 2 initial leafs
+typedef struct{
+	uint64_t	leafs;
+	uint64_t	branches;
+	uint64_t	nibbles;
+	uint64_t	depth[MAX_DEPTH + 1];	// number of leafs per depth (branches above them)
+	uint64_t	depth_sum;
+	uint32_t	max_depth;
+	double		avg_depth;
+	uint64_t	crit_byte[KEYLEN];	// number of branch and nibble nodes per critical byte
+	uint64_t	crit_bit[8];		// number of branches per critical bit (0 is the least significant)
+	uint64_t	nibble_sons[17];	// number of nibble nodes per number of sons
+	uint64_t	leaf_bytes;		// memory used by each node type
+	uint64_t	branch_bytes;
+	uint64_t	nibble_bytes;
+} cb_shape;
+
+// collects the shape of the tree below p with nthreads threads. Returns FAIL, with partial statistics, if the traversal couldn't allocate its tasks.
+int
+cb_shape_stats(void *p, int nthreads, cb_shape *s);
+
+// prints the shape statistics
+void
+cb_shape_print(cb_shape *s, FILE *f);
+
+#endif
@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cb_traverse.h"
+#include "almeidamacros.h"
+
+// a subtree to be visited, and the accumulator it folds into
+typedef struct{
+	void		*node;
+	int		depth;
+	void		*acc;
+} cb_task;
+
+// Each worker owns a contiguous range of tasks, packed as lo | hi << 32 so that a single CAS moves either end.
+// The owner takes tasks from the low end, and idle workers steal from the high end of someone else's range.
+typedef struct cb_worker{
+	uint64_t	range;
+	int		index;
+	struct cb_traversal *t;
+	pthread_t	thread;
+	int		started;
+} cb_worker;
+
+typedef struct cb_traversal{
+	cb_visitor	*v;
+	cb_task		*tasks;
+	cb_worker	*workers;
+	int		nworkers;
+} cb_traversal;
+
+#define range_lo(r) ((uint32_t)(r))
+#define range_hi(r) ((uint32_t)((r) >> 32))
+
+static void cb_visit(void *p, int depth, cb_visitor *v, void *acc){
+	if(!p || p == EMPTY) return; // removed by a concurrent exclusion, or unused
+
+	if(((cb_branch*)p)->type != TYPE_LEAF){
+		int i;
+		if(v->branch) v->branch(p, depth, acc);
+		for(i = 0; i < cb_nsons(p); i++)
+			cb_visit(cb_sons(p)[i], depth+1, v, acc);
+	}
+	else if(v->leaf) v->leaf((cb_leaf*)p, depth, acc);
+}
+
+// takes a task from the worker's own range
+static int cb_pop(cb_worker *w, uint32_t *task){
+	uint64_t r;
+	do{
+		r = w->range;
+		if(range_lo(r) >= range_hi(r)) return FAIL;
+	} while(!CAS(&w->range, r, r + 1));
+	*task = range_lo(r);
+	return SUCCESS;
+}
+
+// takes a task from the high end of another worker's range
+static int cb_steal(cb_worker *w, uint32_t *task){
+	uint64_t r;
+	do{
+		r = w->range;
+		if(range_lo(r) >= range_hi(r)) return FAIL;
+	} while(!CAS(&w->range, r, r - ((uint64_t)1 << 32)));
+	*task = range_hi(r) - 1;
+	return SUCCESS;
+}
+
+static void *cb_work(void *arg){
+	cb_worker *w = (cb_worker*)arg;
+	cb_traversal *t = w->t;
+	uint32_t task = 0;
+	int i;
+
+	while(1){
+		if(!cb_pop(w, &task)){
+			for(i = 1; i < t->nworkers; i++)
+				if(cb_steal(&t->workers[(w->index + i) % t->nworkers], &task)) break;
+			// ranges never grow, so when every one is empty the traversal is done
+			if(i == t->nworkers) return NULL;
+		}
+		cb_visit(t->tasks[task].node, t->tasks[task].depth, t->v, t->tasks[task].acc);
+	}
+}
+
+// Splits the tree into at least target subtrees, keeping them in key order. The branches split here are visited right away, into acc.
+static cb_task *cb_split_tasks(void *p, uint32_t target, cb_visitor *v, void *acc, uint32_t *ntasks){
+	uint32_t n = 1, i, m, expanded = 1;
+	cb_task *tasks = (cb_task*) malloc(sizeof(cb_task));
+	if(!tasks) return NULL;
+	tasks[0].node = p;
+	tasks[0].depth = 0;
+
+	while(n < target && expanded){
+		cb_task *next = (cb_task*) malloc(16*n*sizeof(cb_task));
+		if(!next){
+			free(tasks);
+			return NULL;
+		}
+		expanded = 0;
+		for(i = 0, m = 0; i < n; i++){
+			void *b = tasks[i].node;
+			if(((cb_branch*)b)->type != TYPE_LEAF){
+				int j;
+				if(v->branch) v->branch(b, tasks[i].depth, acc);
+				for(j = 0; j < cb_nsons(b); j++){
+					void *son = cb_sons(b)[j];
+					if(!son || son == EMPTY) continue;
+					next[m].node = son;
+					next[m++].depth = tasks[i].depth + 1;
+				}
+				expanded = 1;
+			}
+			else next[m++] = tasks[i];
+		}
+		free(tasks);
+		tasks = next;
+		n = m;
+	}
+	*ntasks = n;
+	return tasks;
+}
+
+int cb_traverse(void *p, int nthreads, cb_visitor *v, void *acc){
+	cb_traversal t;
+	uint32_t ntasks, i;
+
+	if(!p) return SUCCESS;
+	if(nthreads < 1) nthreads = 1;
+
+	t.v = v;
+	t.nworkers = nthreads;
+	t.tasks = cb_split_tasks(p, nthreads*TASKS_PER_THREAD, v, acc, &ntasks);
+	if(!t.tasks) return FAIL;
+
+	uint8_t *accs = (uint8_t*) calloc(ntasks, v->acc_size);
+	t.workers = (cb_worker*) malloc(nthreads*sizeof(cb_worker));
+	if((!accs && v->acc_size) || !t.workers){
+		free(accs);
+		free(t.workers);
+		free(t.tasks);
+		return FAIL;
+	}
+	for(i = 0; i < ntasks; i++)
+		t.tasks[i].acc = accs + i*v->acc_size;
+
+	// deals the tasks in contiguous ranges
+	for(i = 0; i < nthreads; i++){
+		uint64_t lo = (uint64_t)ntasks*i/nthreads, hi = (uint64_t)ntasks*(i+1)/nthreads;
+		t.workers[i].range = lo | hi << 32;
+		t.workers[i].index = i;
+		t.workers[i].t = &t;
+	}
+	// the calling thread is worker 0. The ranges of workers that couldn't start get stolen.
+	for(i = 1; i < nthreads; i++)
+		t.workers[i].started = !pthread_create(&t.workers[i].thread, NULL, &cb_work, &t.workers[i]);
+	cb_work(&t.workers[0]);
+	for(i = 1; i < nthreads; i++)
+		if(t.workers[i].started) pthread_join(t.workers[i].thread, NULL);
+
+	for(i = 0; i < ntasks; i++)
+		v->combine(acc, t.tasks[i].acc);
+
+	free(accs);
+	free(t.workers);
+	free(t.tasks);
+	return SUCCESS;
+}
+
+static void cb_count_leaf(cb_leaf *leaf, int depth, void *acc){
+	(*(uint64_t*)acc)++;
+}
+
+static void cb_count_combine(void *acc, void *part){
+	*(uint64_t*)acc += *(uint64_t*)part;
+}
+
+uint64_t cb_count(void *p, int nthreads){
+	cb_visitor v = {&cb_count_leaf, NULL, &cb_count_combine, sizeof(uint64_t)};
+	uint64_t n_objs = 0;
+	if(cb_traverse(p, nthreads, &v, &n_objs) == FAIL || n_objs < 2) return 0;
+	return n_objs-2;
+}
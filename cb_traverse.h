@@ -0,0 +1,28 @@
+#ifndef CB_TRAVERSE_H
+#define CB_TRAVERSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cb_tree.h"
+
+#define TASKS_PER_THREAD 16	// subtrees per thread, so threads that finish early have work to steal
+
+// a visitor, called on every node of a traversal.
+// Each subtree gets its own zeroed accumulator of acc_size bytes, and the accumulators are folded with combine in key order, so the result doesn't depend on scheduling.
+typedef struct{
+	void	(*leaf)(cb_leaf *leaf, int depth, void *acc);		// may be NULL
+	void	(*branch)(void *node, int depth, void *acc);		// branch or nibble node, may be NULL
+	void	(*combine)(void *acc, void *part);			// folds part into acc
+	size_t	acc_size;
+} cb_visitor;
+
+// visits every node below p with nthreads threads and folds the results into acc
+int
+cb_traverse(void *p, int nthreads, cb_visitor *v, void *acc);
+
+// counts the leafs below p in parallel (not counting the 2 initial leafs, like cb_print). Returns 0 if the traversal couldn't allocate its tasks.
+uint64_t
+cb_count(void *p, int nthreads);
+
+#endif
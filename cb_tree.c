@@ -55,11 +55,42 @@ do{\
 		if(retries)(*retries)++;\
 		continue
 
+// atomic operations on leaf data
+#define CAS(where, old, new)\
+	__sync_bool_compare_and_swap(where, old, new)
+#define SWAP(where, new)\
+	__atomic_exchange_n(where, new, __ATOMIC_SEQ_CST)
+
 // retrieves the precoputed crit bit mask from the mask table
 #define cb_bit(byte1, byte2)\
 	mask_table[(byte1) ^ (byte2)]
 
-extern cb_tree* critbit;	// the tree
+// position of a key bit in the order the tree tests them, most significant bit of each byte first
+#define cb_pos(byte, mask)\
+	(((byte) << 3) + __builtin_clz((uint32_t)(mask)) - 24)
+
+#define MAX_PATH (KEYLEN*8 + 1)	// a path never tests the same bit twice
+#define PROMOTE_DEPTH 3		// runs of branches inside a nibble this deep become a nibble node
+
+#ifdef COUNTS_ON
+// leaf counts of the sons of a branch or nibble node
+#define cb_counts(p)\
+	(((cb_branch*)(p))->type == TYPE_BRANCH ? ((cb_branch*)(p))->cnt : ((cb_nibble*)(p))->cnt)
+
+#define KEY_STRIPES 1024	// locks serializing the insertions and removals of the same key
+pthread_spinlock_t key_lock[KEY_STRIPES];
+
+static inline pthread_spinlock_t *cb_key_lock(uint8_t *key){
+	uint32_t h = 2166136261u;
+	int i;
+	for(i = 0; i < KEYLEN; i++)
+		h = (h ^ key[i]) * 16777619u;
+	return &key_lock[h % KEY_STRIPES];
+}
+#endif
+
+cb_tree* critbit;		// the tree
+cb_leaf cb_empty;		// the EMPTY son
 uint8_t mask_table[256];	// the mask table
 
 // precomputes bitmasks for every possible combination of byte1 and byte2, so we don't need to calculate it later
@@ -69,8 +100,8 @@ void cb_mask_table_init(){
 	while(1){
 		byte2 = 0;
 		while(1){
-			mask = 1;
-			for(bit = 0; bit < 8 && ((byte1 & mask) == (byte2 & mask)); bit++, mask <<= 1);
+			mask = 0x80;
+			for(bit = 0; bit < 8 && ((byte1 & mask) == (byte2 & mask)); bit++, mask >>= 1);
 			mask_table[byte1 ^ byte2] = mask;
 			byte2++;
 			if(byte2 == 0) break;
@@ -91,26 +122,34 @@ inline void cb_crit_bit(cb_leaf *o1, cb_leaf *o2, cb_branch *n){
 
 // Inicializa a arvore com 2 objetos falsos. O objetivo eh evitar alguns casos especificos de insercoes e remocoes, que soh acontecem quando a arvore contem 0 ou 1 ojeto.
 // Pode-se estudar a inicializacoes da arvore com 4 objetos falsos, ou mesmo a eliminacao desta inicializacao, caso julgue-se desnecessario.
-void cb_init(){
+cb_tree* cb_new(){
 	
-	cb_mask_table_init();
-	
-	critbit = (cb_tree*) calloc(1, sizeof(cb_tree));
+	cb_tree *tree = (cb_tree*) calloc(1, sizeof(cb_tree));
 	
 	cb_leaf *leaf1 = (cb_leaf*) malloc(sizeof(cb_leaf));
 	cb_leaf *leaf2 = (cb_leaf*) malloc(sizeof(cb_leaf));
 	cb_branch *branch = (cb_branch*) malloc(sizeof(cb_branch));
+	if(!tree || !leaf1 || !leaf2 || !branch){
+		debug("malloc() fail");
+		free(tree);
+		free(leaf1);
+		free(leaf2);
+		free(branch);
+		return NULL;
+	}
 	debug("Initial memory allocated");
 
 	leaf1->type = TYPE_LEAF;
 	leaf2->type = TYPE_LEAF;
+	leaf1->data = NULL;
+	leaf2->data = NULL;
 	branch->type = TYPE_BRANCH;
 
 	uint8_t key[KEYLEN];
 	memset(key, 0, KEYLEN);
 
 	memcpy(leaf1->key, key, KEYLEN);
-	key[0] = 1;
+	key[0] = 0x80; // differs on the first bit tested, so the root is never moved down by an insertion
 	memcpy(leaf2->key, key, KEYLEN);
 
 	cb_crit_bit(leaf1, leaf2, branch);
@@ -120,105 +159,551 @@ void cb_init(){
 	debug("Initial nodes set up");
 	LOCK_INIT(&(branch->lock));
 	debug("Initial lock set up");
-	critbit->root = branch;
+#ifdef COUNTS_ON
+	branch->cnt[0] = 1;
+	branch->cnt[1] = 1;
+#endif
+	tree->root = branch;
+	return tree;
+}
+
+void cb_init(){
+	
+	cb_mask_table_init();
+	cb_empty.type = TYPE_LEAF;
+#ifdef COUNTS_ON
+	int i;
+	for(i = 0; i < KEY_STRIPES; i++)
+		LOCK_INIT(&key_lock[i]);
+#endif
+
+	critbit = cb_new();
 
 	verbose("Tree initialized successfully.");
 }
 
-cb_leaf* cb_insert(cb_leaf *leaf, uint32_t *retries){
-	
-	cb_branch *p, *f, *gf; // ponteiros para objeto, pai e avo
-	uint8_t s_direction, f_direction, gf_direction;
-	
-	cb_branch *new_father = (cb_branch*) malloc(sizeof(cb_branch)); // nodo auxiliar
+// son followed by key in a branch or nibble node
+static inline uint8_t cb_index(void *p, uint8_t *key){
+	if(((cb_branch*)p)->type == TYPE_BRANCH)
+		return (key[((cb_branch*)p)->byte] & ((cb_branch*)p)->bitmask) != 0;
+	return (key[((cb_nibble*)p)->byte] >> ((cb_nibble*)p)->shift) & 0xF;
+}
+
+// first position tested by a branch or nibble node, and the one after the last
+static inline int cb_start(void *p){
+	if(((cb_branch*)p)->type == TYPE_BRANCH)
+		return cb_pos(((cb_branch*)p)->byte, ((cb_branch*)p)->bitmask);
+	return (((cb_nibble*)p)->byte << 3) + 4 - ((cb_nibble*)p)->shift;
+}
+
+static inline int cb_end(void *p){
+	return cb_start(p) + (((cb_branch*)p)->type == TYPE_BRANCH ? 1 : 4);
+}
+
+static inline pthread_spinlock_t *cb_lock(void *p){
+	if(((cb_branch*)p)->type == TYPE_BRANCH)
+		return &((cb_branch*)p)->lock;
+	return &((cb_nibble*)p)->lock;
+}
+
+// position of the first bit where two keys differ, or -1 if they are equal
+static inline int cb_crit_pos(uint8_t *key1, uint8_t *key2){
+	uint8_t byte;
+	for(byte = 0; byte < KEYLEN && key1[byte] == key2[byte]; byte++);
+	if(byte == KEYLEN) return -1;
+	return cb_pos(byte, cb_bit(key1[byte], key2[byte]));
+}
+
+// Descends to the leaf sharing the longest prefix with key, taking any other son where a nibble node has no son for it.
+// Returns NULL if the walk was invalidated by a concurrent exclusion.
+static cb_leaf *cb_closest(void *p, uint8_t *key){
+	void *s;
+	int i;
+	while(((cb_branch*)p)->type != TYPE_LEAF){
+		s = cb_sons(p)[cb_index(p, key)];
+		if(s == EMPTY)
+			for(i = 0; i < 16 && (s = ((cb_nibble*)p)->son[i]) == EMPTY; i++);
+		if(s == NULL || s == EMPTY) return NULL;
+		p = s;
+	}
+	return (cb_leaf*)p;
+}
+
+// Locks a run of branches testing bits of nibble nib and hangs the sons leaving the run from the nibble node n, in the slots of their keys' nibble.
+static int cb_run(cb_branch *b, int nib, cb_nibble *n, cb_branch **run, int *nrun){
+	cb_leaf *l;
+	void *x;
+	int i;
+
+	LOCK(&(b->lock));
+	run[(*nrun)++] = b;
+	for(i = 0; i < 2; i++){
+		x = b->son[i];
+		if(x == NULL) return FAIL;
+		if(((cb_branch*)x)->type == TYPE_BRANCH && cb_start(x) >> 2 == nib){
+			if(cb_run((cb_branch*)x, nib, n, run, nrun) == FAIL) return FAIL;
+			continue;
+		}
+		// x is held by b, so its keys can change but they all keep the nibble that brought them here. Any key leads to one of them.
+		while(!(l = cb_closest(x, cb_empty.key)));
+		uint8_t slot = (l->key[n->byte] >> n->shift) & 0xF;
+		if(n->son[slot] != EMPTY) return FAIL;
+		n->son[slot] = x;
+#ifdef COUNTS_ON
+		n->cnt[slot] = b->cnt[i];
+#endif
+		n->count++;
+	}
+	return SUCCESS;
+}
+
+// Replaces the run of branches starting at r, son i of f, with a single nibble node. Readers inside the run find NULL sons and restart.
+static void cb_promote(void *f, uint8_t i, cb_branch *r){
+	cb_branch *run[15];
+	int nrun = 0, j;
+
+	cb_nibble *n = (cb_nibble*) malloc(sizeof(cb_nibble));
+	if(!n) return;
+	n->type = TYPE_NIBBLE;
+	n->byte = r->byte;
+	n->shift = r->bitmask & 0xF0 ? 4 : 0;
+	n->count = 0;
+	for(j = 0; j < 16; j++){
+		n->son[j] = EMPTY;
+#ifdef COUNTS_ON
+		n->cnt[j] = 0;
+#endif
+	}
+	LOCK_INIT(&(n->lock));
+
+	LOCK(cb_lock(f));
+	if(cb_sons(f)[i] != r){
+		UNLOCK(cb_lock(f));
+		free(n);
+		return;
+	}
+	if(cb_run(r, cb_start(r) >> 2, n, run, &nrun) == SUCCESS){
+		cb_sons(f)[i] = n;
+		for(j = 0; j < nrun; j++){
+			run[j]->son[0] = NULL;
+			run[j]->son[1] = NULL;
+		}
+	}
+	else free(n);
+	for(j = nrun - 1; j >= 0; j--)
+		UNLOCK(&(run[j]->lock));
+	UNLOCK(cb_lock(f));
+	/* TODO: Garbage Collection
+	 * The run's branches can't be freed either.
+	 */
+}
+
+// Called after a new branch testing pos was hung below path[d-1]. If it deepened a run of branches inside its nibble, the run becomes a nibble node. The root stays a branch.
+static void cb_deepened(void **path, uint8_t *index, int d, int pos, cb_branch *new_father){
+	int j;
+	for(j = d - 1; j > 0 && ((cb_branch*)path[j])->type == TYPE_BRANCH && cb_start(path[j]) >> 2 == pos >> 2; j--);
+	if(d - j >= PROMOTE_DEPTH && cb_end(path[j]) <= (pos >> 2) << 2)
+		cb_promote(path[j], index[j], j + 1 < d ? (cb_branch*)path[j + 1] : new_father);
+}
+
+// first position where the keys below p may differ
+static inline int cb_span(void *p){
+	return ((cb_branch*)p)->type == TYPE_LEAF ? KEYLEN*8 : cb_start(p);
+}
+
+// Number of leafs below p, a node taken out of a tree. An insertion or removal that was inside it when it was taken may have changed the count above p but not p's yet, and it holds p's lock until it has.
+static inline uint64_t cb_size(void *p){
+#ifdef COUNTS_ON
+	uint64_t n = 0;
+	int i;
+	if(((cb_branch*)p)->type == TYPE_LEAF) return 1;
+	LOCK(cb_lock(p));
+	for(i = 0; i < cb_nsons(p); i++)
+		n += cb_counts(p)[i];
+	UNLOCK(cb_lock(p));
+	return n;
+#else
+	return 1;
+#endif
+}
+
+// Tells whether the node x fits in the empty sons of the nibble node n. Where the keys below x differ inside the nibble, its sons are taken one by one.
+static int cb_fits(cb_nibble *n, void *x){
+	cb_leaf *l;
+	int i;
+	if(cb_span(x) < cb_end(n)){
+		for(i = 0; i < cb_nsons(x); i++)
+			if(cb_sons(x)[i] != EMPTY && !cb_fits(n, cb_sons(x)[i])) return 0;
+		return 1;
+	}
+	while(!(l = cb_closest(x, cb_empty.key)));
+	return n->son[cb_index(n, l->key)] == EMPTY;
+}
+
+// hangs x from the empty sons of the locked nibble node n, once cb_fits() said so
+static void cb_fill(cb_nibble *n, void *x){
+	cb_leaf *l;
+	uint8_t slot;
+	int i;
+	if(cb_span(x) < cb_end(n)){
+		for(i = 0; i < cb_nsons(x); i++)
+			if(cb_sons(x)[i] != EMPTY) cb_fill(n, cb_sons(x)[i]);
+		return;
+	}
+	while(!(l = cb_closest(x, cb_empty.key)));
+	slot = cb_index(n, l->key);
+	n->son[slot] = x;
+#ifdef COUNTS_ON
+	n->cnt[slot] = cb_size(x);
+#endif
+	n->count++;
+}
+
+#define DIVERGES 2	// the keys below a node being hung differ from the tree's before its first bit, or some fall in taken sons of a nibble node, so its sons must be hung one by one
+
+#ifdef COUNTS_ON
+// With counts, the insertion walks down once, holding the locks hand over hand, and adds the leaf to the count of every son it enters.
+// A node can only be hung above a son while its father is locked, so it takes the son's count and later walks find it on their way. The lock of the key keeps it from being inserted or removed meanwhile.
+static int cb_insert_counted(cb_tree *t, cb_leaf *leaf, cb_leaf **found, uint32_t *retries){
+
+	void *path[MAX_PATH];
+	uint8_t index[MAX_PATH];
+	void *f, *p;
+	cb_leaf *l;
+	uint8_t i, direction;
+	int pos, d = 0;
+	cb_branch *new_father;
+	pthread_spinlock_t *key_lock = cb_key_lock(leaf->key);
+
+	LOCK(key_lock);
+	while(!(l = cb_closest(t->root, leaf->key))){
+		if(retries)(*retries)++;
+	}
+	if(cb_crit_pos(leaf->key, l->key) < 0){
+		UNLOCK(key_lock);
+		*found = l;
+		return FAIL;
+	}
+	new_father = (cb_branch*) malloc(sizeof(cb_branch));
 	if(!new_father){
+		UNLOCK(key_lock);
 		debug("malloc() fail");
-		return NULL;
+		return FAIL;
 	}
-	
-// Initalizing some values before finding the position and before locking. Makes de time spent after findind a position and inside the critical section shorter, therefore there will be less concurrency.
-	leaf->type = TYPE_LEAF;
 	new_father->type = TYPE_BRANCH;
 	LOCK_INIT(&(new_father->lock));
 
+	f = t->root;
+	LOCK(cb_lock(f));
 	while(1){
-		f = NULL; gf = NULL; gf_direction = 0; f_direction = 0;
-		p = critbit->root;
-//		debug("Walking through the tree.");
-		while(p->type == TYPE_BRANCH){ // caminha pela arvore
-			gf_direction = f_direction;
-			f_direction = (leaf->key[p->byte] & p->bitmask) != 0; // decide a direcao
-			gf = f;
-			f = p;
-			p = p->son[f_direction];
-			if(p == NULL){
-//				debug("Position invalidated by a concurrent exclusion. Restarting the search.");
-				f = NULL; gf = NULL; gf_direction = 0; f_direction = 0; p = critbit->root;
-				retrying();
-			}
+		i = cb_index(f, leaf->key);
+		path[d] = f;
+		index[d++] = i;
+		p = cb_sons(f)[i];
+		if(p == EMPTY){
+			((cb_nibble*)f)->son[i] = leaf;
+			((cb_nibble*)f)->cnt[i] = 1;
+			((cb_nibble*)f)->count++;
+			UNLOCK(cb_lock(f));
+			UNLOCK(key_lock);
+			free(new_father);
+			return SUCCESS;
 		}
-//		debug("Found the position.");
-		// Encontrou a posicao. Se o nodo jah existe e o novo objeto nao e' vary, nao insere e retorna NULL.
-		if(!memcmp(leaf->key, ((cb_leaf*)p)->key, KEYLEN)){
+		// p can't move while f is locked, so any of its leafs tells whether the key belongs below it
+		while(!(l = cb_closest(p, leaf->key))){
+			if(retries)(*retries)++;
+		}
+		pos = cb_crit_pos(leaf->key, l->key);
+		if(((cb_branch*)p)->type == TYPE_LEAF || pos < cb_start(p)) break;
+		LOCK(cb_lock(p));
+		cb_counts(f)[i]++;
+		UNLOCK(cb_lock(f));
+		f = p;
+	}
+
+	new_father->byte = pos >> 3;
+	new_father->bitmask = 0x80 >> (pos & 7);
+	direction = (leaf->key[new_father->byte] & new_father->bitmask) != 0;
+	new_father->son[direction] = leaf;
+	new_father->son[1 - direction] = p;
+	new_father->cnt[direction] = 1;
+	new_father->cnt[1 - direction] = cb_counts(f)[i];
+	cb_sons(f)[i] = new_father;
+	cb_counts(f)[i]++;
+
+	UNLOCK(cb_lock(f));
+	UNLOCK(key_lock);
+
+	cb_deepened(path, index, d, pos, new_father);
+	return SUCCESS;
+}
+
+// Hangs a whole subtree in a counted tree. Its size is only added to the counts once the place is found, so the path stays locked until then.
+static int cb_graft_counted(cb_tree *t, void *node, uint8_t *key, uint32_t *retries){
+
+	void *path[MAX_PATH];
+	uint8_t index[MAX_PATH];
+	void *f, *p;
+	cb_leaf *l;
+	uint8_t direction;
+	int pos, d, k;
+	uint64_t size = cb_size(node);
+	cb_branch *new_father = (cb_branch*) malloc(sizeof(cb_branch));
+
+	if(!new_father) return FAIL;
+	new_father->type = TYPE_BRANCH;
+	LOCK_INIT(&(new_father->lock));
+
+	d = 0;
+	f = t->root;
+	LOCK(cb_lock(f));
+	while(1){
+		path[d] = f;
+		index[d] = cb_index(f, key);
+		p = cb_sons(f)[index[d++]];
+		if(p == EMPTY){
+			pos = cb_start(f);
+			break;
+		}
+		while(!(l = cb_closest(p, key))){
+			if(retries)(*retries)++;
+		}
+		pos = cb_crit_pos(key, l->key);
+		if(pos < 0 || pos >= cb_span(node)) break;
+		if(((cb_branch*)p)->type == TYPE_LEAF || pos < cb_start(p)) break;
+		LOCK(cb_lock(p));
+		f = p;
+	}
+
+	if(p != EMPTY && (pos < 0 || pos >= cb_span(node))){
+		for(k = d - 1; k >= 0; k--)
+			UNLOCK(cb_lock(path[k]));
+		free(new_father);
+		return pos < 0 ? FAIL : DIVERGES;
+	}
+	if(p == EMPTY && !cb_fits((cb_nibble*)f, node)){
+		for(k = d - 1; k >= 0; k--)
+			UNLOCK(cb_lock(path[k]));
+		free(new_father);
+		return DIVERGES;
+	}
+
+	// the counts of the nibble's sons are set by cb_fill()
+	for(k = 0; k < (p == EMPTY ? d - 1 : d); k++)
+		cb_counts(path[k])[index[k]] += size;
+	if(p == EMPTY){
+		cb_fill((cb_nibble*)f, node);
+		free(new_father);
+	}
+	else{
+		new_father->byte = pos >> 3;
+		new_father->bitmask = 0x80 >> (pos & 7);
+		direction = (key[new_father->byte] & new_father->bitmask) != 0;
+		new_father->son[direction] = node;
+		new_father->son[1 - direction] = p;
+		new_father->cnt[direction] = size;
+		new_father->cnt[1 - direction] = cb_counts(f)[index[d-1]] - size;
+		cb_sons(f)[index[d-1]] = new_father;
+	}
+	for(k = d - 1; k >= 0; k--)
+		UNLOCK(cb_lock(path[k]));
+
+	if(p != EMPTY) cb_deepened(path, index, d, pos, new_father);
+	return SUCCESS;
+}
+#endif
+
+// The insertion walks down twice.
+// First we find the leaf closest to the new key, which tells the position of the bit that tells them apart. Then we walk down again until the first node testing a later bit, and hang a new branch from its father, holding only the father's lock.
+// If the position falls inside a nibble node, the leaf goes straight into its empty son.
+// node may also be a whole subtree, taken from another tree, and key the key of any leaf below it.
+// Returns FAIL and the leaf already holding key in found, or DIVERGES when the tree has keys sharing node's prefix or node doesn't fit in a nibble node's empty sons.
+static int cb_insert_node(cb_tree *t, void *node, uint8_t *key, cb_leaf **found, uint32_t *retries){
+	
+	void *path[MAX_PATH];
+	uint8_t index[MAX_PATH];
+	void *p, *f;
+	cb_leaf *l;
+	uint8_t i, direction;
+	int pos, d;
+	cb_branch *new_father = NULL; // nodo auxiliar
+	
+	*found = NULL;
+#ifdef COUNTS_ON
+	if(((cb_branch*)node)->type == TYPE_LEAF) return cb_insert_counted(t, (cb_leaf*)node, found, retries);
+	return cb_graft_counted(t, node, key, retries);
+#endif
+
+	while(1){
+		l = cb_closest(t->root, key);
+		if(!l){
+//			debug("Position invalidated by a concurrent exclusion. Restarting the search.");
+			retrying();
+		}
+		pos = cb_crit_pos(key, l->key);
+		if(pos < 0){
 			free(new_father);
+			*found = l;
 //			debug("Occupied position. Key is already in the tree.");
-			return NULL;
+			return FAIL;
+		}
+		if(pos >= cb_span(node)){
+			free(new_father);
+			return DIVERGES;
+		}
+
+// Allocating and initalizing the new branch before finding the position and before locking. Makes de time spent after findind a position and inside the critical section shorter, therefore there will be less concurrency.
+// It is only done once the key is known to be missing, so updates of existing keys don't pay for it.
+		if(!new_father){
+			new_father = (cb_branch*) malloc(sizeof(cb_branch));
+			if(!new_father){
+				debug("malloc() fail");
+				return FAIL;
+			}
+			new_father->type = TYPE_BRANCH;
+			LOCK_INIT(&(new_father->lock));
 		}
 
-		// Locks no avo (se existente) e no pai.
-		if(gf){
-			LOCK(&(gf->lock));
-//			debug("Grandfather's lock obtained.");
-			if(gf->son[gf_direction] != f){
-//				debug("Link Grandfather -> Father lost.");
-				UNLOCK(&(gf->lock));
-//				debug("Grandfather's lock released.");
-//				debug("Object not inserted. Trying again.");
+		f = NULL; p = t->root; d = 0; i = 0;
+		while(((cb_branch*)p)->type != TYPE_LEAF && cb_end(p) <= pos){ // caminha pela arvore
+			i = cb_index(p, key);
+			path[d] = p;
+			index[d++] = i;
+			f = p;
+			p = cb_sons(p)[i];
+			if(p == NULL || p == EMPTY) break;
+		}
+		if(p == NULL || p == EMPTY){
+//			debug("Position invalidated by a concurrent modification. Restarting the search.");
+			retrying();
+		}
+
+		if(((cb_branch*)p)->type != TYPE_LEAF && cb_start(p) <= pos){
+			// A branch testing pos would have sent the key to a leaf differing elsewhere, so the tree changed.
+			if(((cb_branch*)p)->type == TYPE_BRANCH){
 				retrying();
 			}
+			cb_nibble *n = (cb_nibble*)p;
+			i = cb_index(n, key);
+			LOCK(&(n->lock));
+			// the son must still be empty, and the key must still share the prefix above the nibble
+			if(n->son[i] != EMPTY || !(l = cb_closest(n, key)) || cb_crit_pos(key, l->key) < cb_start(n)){
+				UNLOCK(&(n->lock));
+				retrying();
+			}
+			if(!cb_fits(n, node)){
+				UNLOCK(&(n->lock));
+				free(new_father);
+				return DIVERGES;
+			}
+			cb_fill(n, node);
+			UNLOCK(&(n->lock));
+			free(new_father);
+			return SUCCESS;
 		}
-		
-		LOCK(&(f->lock));
+
+		LOCK(cb_lock(f));
 //		debug("Father's lock obtained");
-		if(f->son[f_direction] != p){
+		if(cb_sons(f)[i] != p){
 //			debug("Link Father -> Son lost.");
-			UNLOCK(&(f->lock));
-//			debug("Father's lock released.");
-			if(gf){
-				UNLOCK(&(gf->lock));
-//				debug("Grandfather's lock released.");
-			}
+			UNLOCK(cb_lock(f));
 //			debug("Object not inserted. Trying again.");
 			retrying();
 		}
-//		debug("Setting up new leaf.");
+		// p can't move while its father is locked, but its subtree can. Any of its leafs still shares the prefix above p.
+		if(!(l = cb_closest(p, key)) || cb_crit_pos(key, l->key) != pos){
+			UNLOCK(cb_lock(f));
+			if(l && cb_crit_pos(key, l->key) < 0){
+				free(new_father);
+				*found = l;
+				return FAIL;
+			}
+			retrying();
+		}
 
-		// Tudo certo. Inicializamos o nodo auxiliar com as informacoes de roteamento, ligamos os objetos a ele, inicializamos o seu lock e inserimos ele na árvore com CAS.
-		// Se o CAS falhar, significa que tivemos uma modificacao naquele ponto da arvore, e temos que procurar a nova posicao a inserir o objeto.
-		cb_crit_bit(leaf, (cb_leaf*)p, new_father);
-		s_direction = (leaf->key[new_father->byte] & new_father->bitmask) != 0;
-		new_father->son[s_direction] = leaf;
-		new_father->son[1 - s_direction] = p;
-		f->son[f_direction] = new_father;
+		new_father->byte = pos >> 3;
+		new_father->bitmask = 0x80 >> (pos & 7);
+		direction = (key[new_father->byte] & new_father->bitmask) != 0;
+		new_father->son[direction] = node;
+		new_father->son[1 - direction] = p;
+		cb_sons(f)[i] = new_father;
 
-		UNLOCK(&(f->lock));
-		if(gf) UNLOCK(&(gf->lock));
-//		debug("Both locks released.");
+		UNLOCK(cb_lock(f));
+//		debug("Father's lock released.");
+
+		cb_deepened(path, index, d, pos, new_father);
 
 //		verbose("New object inserted successfully.");
-		return leaf;
+		return SUCCESS;
 	}
 }
 
+// Inserts leaf, or returns NULL and the leaf already holding its key in found.
+static cb_leaf* cb_insert_leaf(cb_tree *t, cb_leaf *leaf, cb_leaf **found, uint32_t *retries){
+	leaf->type = TYPE_LEAF;
+	if(cb_insert_node(t, leaf, leaf->key, found, retries) == SUCCESS) return leaf;
+	return NULL;
+}
+
+cb_leaf* cb_insert(cb_leaf *leaf, uint32_t *retries){
+	return cb_tree_insert(critbit, leaf, retries);
+}
+
+cb_leaf* cb_tree_insert(cb_tree *t, cb_leaf *leaf, uint32_t *retries){
+	cb_leaf *found;
+	return cb_insert_leaf(t, leaf, &found, retries);
+}
+
+cb_leaf* cb_get_or_insert(cb_leaf *leaf, uint32_t *retries){
+	return cb_tree_get_or_insert(critbit, leaf, retries);
+}
+
+cb_leaf* cb_tree_get_or_insert(cb_tree *t, cb_leaf *leaf, uint32_t *retries){
+	cb_leaf *found = NULL;
+	leaf->type = TYPE_LEAF;
+	if(cb_insert_node(t, leaf, leaf->key, &found, retries) == SUCCESS) return leaf;
+	return found;
+}
+
+cb_leaf* cb_upsert(cb_leaf *leaf, void **old, uint32_t *retries){
+	return cb_tree_upsert(critbit, leaf, old, retries);
+}
+
+// The data pointer is swapped in place, without locks. An upsert racing with the removal of its key may update the leaf just removed, as if it had happened first.
+cb_leaf* cb_tree_upsert(cb_tree *t, cb_leaf *leaf, void **old, uint32_t *retries){
+	cb_leaf *found = NULL;
+	*old = NULL;
+	if(cb_insert_leaf(t, leaf, &found, retries)) return leaf;
+	if(found) *old = SWAP(&(found->data), leaf->data);
+	return found;
+}
+
+int cb_cas_data(uint8_t *key, void *expected, void *desired, uint32_t *retries){
+	return cb_tree_cas_data(critbit, key, expected, desired, retries);
+}
+
+int cb_tree_cas_data(cb_tree *t, uint8_t *key, void *expected, void *desired, uint32_t *retries){
+	cb_leaf *leaf = cb_tree_find(t, key, retries);
+	if(!leaf) return FAIL;
+	return CAS(&(leaf->data), expected, desired) ? SUCCESS : FAIL;
+}
 
 cb_leaf *cb_find(uint8_t *key, uint32_t *retries){
-	cb_branch *p = critbit->root;
+	return cb_tree_find(critbit, key, retries);
+}
+
+cb_leaf *cb_tree_find(cb_tree *t, uint8_t *key, uint32_t *retries){
+	void *p = t->root;
 //	debug("Walking through the tree.");
-	while(p->type == TYPE_BRANCH){ // Caminhamento pela arvore
-		p = p->son[(key[p->byte] & p->bitmask) != 0];
+	while(((cb_branch*)p)->type != TYPE_LEAF){ // Caminhamento pela arvore
+		p = cb_sons(p)[cb_index(p, key)];
+		if(p == EMPTY){ // Nibble node without a son for this key
+//			verbose("Object not found.");
+			return NULL;
+		}
 		if(p == NULL){ // Posicao invalidada por uma remocao paralela;
 //			debug("Position invalidated by a concurrent exclusion. Restarting the search.");
-			p = critbit->root; // Reinicia a busca.
+			p = t->root; // Reinicia a busca.
 			retrying();
 		}
 	}
@@ -234,64 +719,424 @@ cb_leaf *cb_find(uint8_t *key, uint32_t *retries){
 	return NULL;
 }
 
+// tells the 2 initial leafs, whose keys can't be inserted, from the others
+static int cb_initial(cb_leaf *l){
+	int i;
+	if(l->key[0] & 0x7F) return 0;
+	for(i = 1; i < KEYLEN; i++)
+		if(l->key[i]) return 0;
+	return 1;
+}
+
+// Descends to the leftmost (up) or rightmost leaf below p. Returns NULL if the walk was invalidated by a concurrent exclusion.
+static cb_leaf *cb_edge(void *p, int up){
+	void *s = NULL;
+	int i, n;
+	while(((cb_branch*)p)->type != TYPE_LEAF){
+		n = cb_nsons(p);
+		for(i = 0; i < n; i++)
+			if((s = cb_sons(p)[up ? i : n-1-i]) != EMPTY) break;
+		if(s == NULL || s == EMPTY) return NULL;
+		p = s;
+	}
+	return (cb_leaf*)p;
+}
+
+// Finds the leaf with the smallest key after key (up) or the largest one before it, or key itself unless strict.
+// Like an insertion, it finds the closest leaf and walks down again to the subtree where key diverges from the tree. Every key in that subtree is on the same side of key, so the answer is its first or last leaf, or else the first or last leaf of the nearest son beside the path.
+static cb_leaf *cb_neighbor(cb_tree *t, uint8_t *key, int up, int strict, uint32_t *retries){
+	void *path[MAX_PATH];
+	uint8_t index[MAX_PATH];
+	void *p, *s;
+	cb_leaf *l;
+	int pos, d, i, j, invalid;
+
+	while(1){
+		l = cb_closest(t->root, key);
+		if(!l){
+			retrying();
+		}
+		pos = cb_crit_pos(key, l->key);
+		if(pos < 0){
+			if(!strict && !cb_initial(l)) return l;
+			pos = KEYLEN*8; // walks down to the leaf itself, which is then skipped
+		}
+
+		p = t->root; d = 0;
+		while(((cb_branch*)p)->type != TYPE_LEAF && cb_end(p) <= pos){
+			i = cb_index(p, key);
+			path[d] = p;
+			index[d++] = i;
+			p = cb_sons(p)[i];
+			if(p == NULL || p == EMPTY) break;
+		}
+		if(p == NULL || p == EMPTY || (((cb_branch*)p)->type == TYPE_BRANCH && cb_start(p) <= pos)){
+//			debug("Position invalidated by a concurrent modification. Restarting the search.");
+			retrying();
+		}
+
+		// The tree may have changed since pos was found, so a leaf below p must still tell key apart where the walk stopped. Then key shares the prefix of every node on the path.
+		if(pos < KEYLEN*8){
+			l = cb_closest(p, key);
+			if(!l || (((cb_branch*)p)->type == TYPE_NIBBLE && cb_start(p) <= pos ? cb_crit_pos(key, l->key) < cb_start(p) : cb_crit_pos(key, l->key) != pos)){
+				retrying();
+			}
+		}
+
+		if(((cb_branch*)p)->type == TYPE_NIBBLE && cb_start(p) <= pos){
+			// key diverges inside the nibble, where its own son is empty and the others are ordered by nibble value
+			i = cb_index(p, key);
+			if(cb_sons(p)[i] != EMPTY){
+				retrying();
+			}
+			path[d] = p;
+			index[d++] = i;
+			p = NULL;
+		}
+		else if(pos == KEYLEN*8){
+			if(memcmp(key, ((cb_leaf*)p)->key, KEYLEN)){
+				retrying();
+			}
+			p = NULL;
+		}
+		// the subtree is after key if key has a 0 where they diverge
+		else if((((key[pos >> 3] << (pos & 7)) & 0x80) != 0) == up)
+			p = NULL;
+
+		// the subtree is on the wrong side of key, so we look for the nearest son beside the path
+		invalid = 0;
+		for(; d > 0 && !p && !invalid; d--){
+			s = path[d-1];
+			for(j = index[d-1] + (up ? 1 : -1); j >= 0 && j < cb_nsons(s); j += up ? 1 : -1){
+				p = cb_sons(s)[j];
+				if(p == NULL) invalid = 1;
+				if(p != EMPTY) break;
+				p = NULL;
+			}
+		}
+		if(invalid){
+			retrying();
+		}
+		if(!p) return NULL;
+
+		l = cb_edge(p, up);
+		if(!l){
+			retrying();
+		}
+		// skips the initial leafs
+		if(cb_initial(l)){
+			key = l->key;
+			strict = 1;
+			continue;
+		}
+		return l;
+	}
+}
+
+cb_leaf* cb_ceil(uint8_t *key, uint32_t *retries){
+	return cb_neighbor(critbit, key, 1, 0, retries);
+}
+
+cb_leaf* cb_floor(uint8_t *key, uint32_t *retries){
+	return cb_neighbor(critbit, key, 0, 0, retries);
+}
+
+cb_leaf* cb_min(uint32_t *retries){
+	return cb_tree_min(critbit, retries);
+}
+
+cb_leaf* cb_max(uint32_t *retries){
+	return cb_tree_max(critbit, retries);
+}
+
+cb_leaf* cb_tree_min(cb_tree *t, uint32_t *retries){
+	uint8_t key[KEYLEN];
+	memset(key, 0, KEYLEN);
+	return cb_neighbor(t, key, 1, 0, retries);
+}
+
+cb_leaf* cb_tree_max(cb_tree *t, uint32_t *retries){
+	uint8_t key[KEYLEN];
+	memset(key, 0xFF, KEYLEN);
+	return cb_neighbor(t, key, 0, 0, retries);
+}
+
+cb_leaf* cb_tree_ceil(cb_tree *t, uint8_t *key, int strict, uint32_t *retries){
+	return cb_neighbor(t, key, 1, strict, retries);
+}
+
+cb_leaf* cb_tree_floor(cb_tree *t, uint8_t *key, int strict, uint32_t *retries){
+	return cb_neighbor(t, key, 0, strict, retries);
+}
+
+// Unlinks son fi of f while f and its father gf are locked. A branch goes away with it, so the grandfather points to the other son.
+// A nibble node just empties the son, unless only one son would remain. In that case the grandfather points to that son instead.
+// The sons of the nodes taken out become NULL, so readers inside them restart.
+static void cb_unlink(void *gf, uint8_t gf_direction, void *f, uint8_t f_direction){
+	int i;
+	if(((cb_branch*)f)->type == TYPE_BRANCH){
+		cb_sons(gf)[gf_direction] = ((cb_branch*)f)->son[1 - f_direction];
+#ifdef COUNTS_ON
+		cb_counts(gf)[gf_direction] = ((cb_branch*)f)->cnt[1 - f_direction];
+#endif
+		((cb_branch*)f)->son[0] = NULL;
+		((cb_branch*)f)->son[1] = NULL;
+	}
+	else{
+		cb_nibble *n = (cb_nibble*)f;
+		n->son[f_direction] = EMPTY;
+#ifdef COUNTS_ON
+		n->cnt[f_direction] = 0;
+#endif
+		if(--n->count == 1){
+			for(i = 0; i < 16; i++)
+				if(n->son[i] != EMPTY){
+					cb_sons(gf)[gf_direction] = n->son[i];
+#ifdef COUNTS_ON
+					cb_counts(gf)[gf_direction] = n->cnt[i];
+#endif
+				}
+			for(i = 0; i < 16; i++)
+				n->son[i] = NULL;
+		}
+	}
+}
+
+#ifdef COUNTS_ON
+// number of leafs smaller than key, counting the initial ones.
+// Like cb_neighbor(), it walks down to the subtree where key diverges from the tree, adding the counts of the sons before the path.
+static uint64_t cb_rank_all(cb_tree *t, uint8_t *key, uint32_t *retries){
+	void *p, *f;
+	cb_leaf *l;
+	uint64_t r;
+	int pos, i, j;
+
+	while(1){
+		l = cb_closest(t->root, key);
+		if(!l){
+			retrying();
+		}
+		pos = cb_crit_pos(key, l->key);
+		if(pos < 0) pos = KEYLEN*8;
+
+		r = 0; f = NULL; i = 0;
+		p = t->root;
+		while(((cb_branch*)p)->type != TYPE_LEAF && cb_end(p) <= pos){
+			i = cb_index(p, key);
+			for(j = 0; j < i; j++)
+				r += cb_counts(p)[j];
+			f = p;
+			p = cb_sons(p)[i];
+			if(p == NULL || p == EMPTY) break;
+		}
+		if(p == NULL || p == EMPTY || (((cb_branch*)p)->type == TYPE_BRANCH && cb_start(p) <= pos)){
+			retrying();
+		}
+
+		// as in cb_neighbor(), a leaf below p must still tell key apart where the walk stopped
+		if(pos < KEYLEN*8){
+			l = cb_closest(p, key);
+			if(!l || (((cb_branch*)p)->type == TYPE_NIBBLE && cb_start(p) <= pos ? cb_crit_pos(key, l->key) < cb_start(p) : cb_crit_pos(key, l->key) != pos)){
+				retrying();
+			}
+		}
+
+		if(((cb_branch*)p)->type == TYPE_NIBBLE && cb_start(p) <= pos){
+			i = cb_index(p, key);
+			for(j = 0; j < i; j++)
+				r += cb_counts(p)[j];
+		}
+		else if(pos == KEYLEN*8){
+			if(memcmp(key, ((cb_leaf*)p)->key, KEYLEN)){
+				retrying();
+			}
+		}
+		// the whole subtree is before key if key has a 1 where they diverge
+		else if((key[pos >> 3] << (pos & 7)) & 0x80)
+			r += cb_counts(f)[i];
+		return r;
+	}
+}
+
+// the initial leafs are smaller than key
+static int cb_initial_before(uint8_t *key){
+	uint8_t initial[KEYLEN];
+	memset(initial, 0, KEYLEN);
+	int n = memcmp(key, initial, KEYLEN) > 0;
+	initial[0] = 0x80;
+	return n + (memcmp(key, initial, KEYLEN) > 0);
+}
+
+uint64_t cb_rank(uint8_t *key, uint32_t *retries){
+	return cb_tree_rank(critbit, key, retries);
+}
+
+uint64_t cb_tree_rank(cb_tree *t, uint8_t *key, uint32_t *retries){
+	return cb_rank_all(t, key, retries) - cb_initial_before(key);
+}
+
+uint64_t cb_range_count(uint8_t *lo, uint8_t *hi, uint32_t *retries){
+	return cb_tree_range_count(critbit, lo, hi, retries);
+}
+
+uint64_t cb_tree_range_count(cb_tree *t, uint8_t *lo, uint8_t *hi, uint32_t *retries){
+	uint64_t r_lo, r_hi;
+	if(memcmp(lo, hi, KEYLEN) >= 0) return 0;
+	r_lo = cb_tree_rank(t, lo, retries);
+	r_hi = cb_tree_rank(t, hi, retries);
+	return r_hi > r_lo ? r_hi - r_lo : 0;
+}
+
+cb_leaf* cb_select(uint64_t k, uint32_t *retries){
+	return cb_tree_select(critbit, k, retries);
+}
+
+// Walks down from the root skipping whole sons by their counts.
+cb_leaf* cb_tree_select(cb_tree *t, uint64_t k, uint32_t *retries){
+	void *p, *s;
+	uint8_t initial[KEYLEN];
+	uint64_t k_all, c;
+	int i, n;
+
+	memset(initial, 0, KEYLEN);
+	initial[0] = 0x80;
+
+	while(1){
+		// Skips the initial leaf before every key, and the one in the middle if the k-th key is after it.
+		// Keys before the middle one may come and go meanwhile, so this is found again on every retry.
+		k_all = k + 1;
+		if(k_all >= cb_rank_all(t, initial, retries)) k_all++;
+
+		p = t->root;
+		c = k_all;
+		while(p && p != EMPTY && ((cb_branch*)p)->type != TYPE_LEAF){
+			n = cb_nsons(p);
+			s = NULL;
+			for(i = 0; i < n; i++){
+				if(cb_sons(p)[i] == EMPTY) continue;
+				s = cb_sons(p)[i];
+				if(c < cb_counts(p)[i]) break;
+				c -= cb_counts(p)[i];
+			}
+			// past the last leaf. Below the root, the counts just haven't caught up with a concurrent update.
+			if(i == n && p == t->root) return NULL;
+			p = s;
+		}
+		if(!p || p == EMPTY || cb_initial((cb_leaf*)p)){
+			retrying();
+		}
+		return (cb_leaf*)p;
+	}
+}
+
+// With counts, the removal walks down holding the locks hand over hand, and takes the leaf out of the count of every son it enters.
+// The lock of the key keeps other insertions and removals of the key away, and cb_remove_prefix() locks the root before the walk can, so the key is still found at its end.
+static cb_leaf* cb_remove_counted(cb_tree *t, uint8_t *key, uint32_t *retries){
+	void *p, *f, *gf = NULL;
+	uint8_t f_direction, gf_direction = 0;
+	cb_leaf *l;
+	pthread_spinlock_t *key_lock = cb_key_lock(key);
+
+	LOCK(key_lock);
+	f = t->root;
+	LOCK(cb_lock(f));
+	l = cb_tree_find(t, key, retries);
+	// The initial leafs are never removed.
+	if(!l || cb_initial(l)){
+		UNLOCK(cb_lock(f));
+		UNLOCK(key_lock);
+		return NULL;
+	}
+
+	while(1){
+		f_direction = cb_index(f, key);
+		p = cb_sons(f)[f_direction];
+		if(((cb_branch*)p)->type == TYPE_LEAF) break;
+		LOCK(cb_lock(p));
+		cb_counts(f)[f_direction]--;
+		if(gf) UNLOCK(cb_lock(gf));
+		gf = f;
+		gf_direction = f_direction;
+		f = p;
+	}
+
+	cb_unlink(gf, gf_direction, f, f_direction);
+
+	UNLOCK(cb_lock(f));
+	UNLOCK(cb_lock(gf));
+	UNLOCK(key_lock);
+	return (cb_leaf*)p;
+}
+#endif
+
 // A remocao eh parecida com a insercao.
 // Basicamente, caminhamos pela arvore ate encontrar o objeto. Encontrado este, adquirimos os locks do pai e do avo, verificamos a consistencia da ligacao do pai com o objeto e entao apontamos o avo para o objeto irmao. Dessa maneira, excluimos da arvore o objeto desejado e o nodo auxiliar (pai) que ligava os dois objetos. Agora, o avo tornou-se pai do objeto irmao.
 int cb_remove(uint8_t *key, uint32_t *retries){
-	cb_branch *p, *f, *gf;
-	cb_leaf *return_leaf;
+	return cb_tree_remove(critbit, key, retries);
+}
+
+int cb_tree_remove(cb_tree *t, uint8_t *key, uint32_t *retries){
+	return cb_tree_take(t, key, retries) ? SUCCESS : FAIL;
+}
+
+cb_leaf* cb_tree_take(cb_tree *t, uint8_t *key, uint32_t *retries){
+	void *p, *f, *gf;
 	uint8_t f_direction, gf_direction;
 		
+#ifdef COUNTS_ON
+	return cb_remove_counted(t, key, retries);
+#endif
 	while(1){
-		f = NULL; gf = NULL;
-		p = critbit->root;
+		f = NULL; gf = NULL; f_direction = 0; gf_direction = 0;
+		p = t->root;
 //		debug("Walking through the tree.");
-		while(p->type == TYPE_BRANCH){
+		while(((cb_branch*)p)->type != TYPE_LEAF){
 			gf_direction = f_direction;
-			f_direction = (key[p->byte] & p->bitmask) != 0;
+			f_direction = cb_index(p, key);
 			gf = f;
 			f = p;
-			p = p->son[f_direction];
-			if(p == NULL){
-//				debug("Position invalidated by a concurrent exclusion. Restarting the search.");
-				f = NULL; gf = NULL; p = critbit->root;
-				retrying();
-			}
+			p = cb_sons(p)[f_direction];
+			if(p == NULL || p == EMPTY) break;
+		}
+		if(p == NULL){
+//			debug("Position invalidated by a concurrent exclusion. Restarting the search.");
+			retrying();
 		}
 //		debug("Found the position.");
 
-		if(memcmp(key, ((cb_leaf*)p)->key, KEYLEN) != 0){
+		if(p == EMPTY || memcmp(key, ((cb_leaf*)p)->key, KEYLEN) != 0){
 //			debug("Object not found.");
-			return FAIL;
+			return NULL;
 		}
+		// The initial leafs are never removed. They only hang from the root until other keys share their prefix.
+		if(cb_initial((cb_leaf*)p)) return NULL;
 
-		LOCK(&(gf->lock));
+		LOCK(cb_lock(gf));
 //		debug("Grandfather's lock obtained.");
-		if(gf->son[gf_direction] != f){
+		if(cb_sons(gf)[gf_direction] != f){
 //			debug("Link Grandfather -> Father lost.");
-			UNLOCK(&(gf->lock));
+			UNLOCK(cb_lock(gf));
 //			debug("Grandfather's lock released.");
 //			debug("Leaf not removed. Trying again.");
 			retrying();
 		}
 
-		LOCK(&(f->lock));
+		LOCK(cb_lock(f));
 //		debug("Father's lock obtained.");
-		if(f->son[f_direction] != p){
+		if(cb_sons(f)[f_direction] != p){
 //			debug("Link Father -> Son lost.");
-			UNLOCK(&(f->lock));
+			UNLOCK(cb_lock(f));
 //			debug("Father's lock released.");
-			UNLOCK(&(gf->lock));
+			UNLOCK(cb_lock(gf));
 //			debug("Grandfather's lock released.");
 //			debug("Leaf not removed. Trying again.");
 			retrying();
 		}
 
-		gf->son[gf_direction] = f->son[1 - f_direction];
-		f->son[0] = NULL;
-		f->son[1] = NULL;
+		cb_unlink(gf, gf_direction, f, f_direction);
 		
-		UNLOCK(&(f->lock));
-		UNLOCK(&(gf->lock));
+		UNLOCK(cb_lock(f));
+		UNLOCK(cb_lock(gf));
 //		debug("Both locks released.");
 
 		/* TODO: Garbage Collection
@@ -301,13 +1146,327 @@ int cb_remove(uint8_t *key, uint32_t *retries){
 //		free(p);
 			
 //		verbose("Object successfully removed.");
+		return (cb_leaf*)p;
+	}
+}
+
+// tells whether the initial leafs' keys start with the first bits of prefix, which is the case if they are all zeros, but for the first one
+static int cb_prefix_initial(uint8_t *prefix, int bits){
+	int i;
+	for(i = 1; i < bits; i++)
+		if((prefix[i >> 3] << (i & 7)) & 0x80) return 0;
+	return 1;
+}
+
+// All keys starting with the prefix hang from the first node testing a later bit, so they are unlinked at once, like cb_remove() unlinks a leaf.
+// If the prefix ends inside a nibble node, only the sons matching it are taken. When they are more than one, they are handed out under a new nibble node.
+// The subtree isn't walked, so operations that were already inside it may still finish there, as if they had happened before its removal.
+static int cb_detach_prefix(cb_tree *t, uint8_t *prefix, int bits, void **subtree, uint32_t *retries){
+	void *path[MAX_PATH];
+	uint8_t index[MAX_PATH];
+	void *p;
+	cb_leaf *l;
+	cb_nibble *n, *out = NULL;
+	int d, k, first, partial, pos, lim, shift, j, m;
+#ifdef COUNTS_ON
+	uint64_t c;
+#endif
+
+	*subtree = NULL;
+	// the initial leafs can't be removed
+	if(bits < 0 || bits > KEYLEN*8 || cb_prefix_initial(prefix, bits)) return FAIL;
+
+	while(1){
+		p = t->root; d = 0;
+		while(((cb_branch*)p)->type != TYPE_LEAF && cb_end(p) <= bits){
+			path[d] = p;
+			index[d] = cb_index(p, prefix);
+			p = cb_sons(p)[index[d++]];
+			if(p == NULL || p == EMPTY) break;
+		}
+		if(p == NULL){
+			retrying();
+		}
+		if(p == EMPTY){
+			free(out);
+			return FAIL;
+		}
+
+		partial = ((cb_branch*)p)->type == TYPE_NIBBLE && cb_start(p) < bits;
+		if(partial && !out){
+			out = (cb_nibble*) malloc(sizeof(cb_nibble));
+			if(!out) return FAIL;
+			out->type = TYPE_NIBBLE;
+			LOCK_INIT(&(out->lock));
+		}
+
+		// Locks the father and the grandfather, like cb_remove(). With counts the whole path is locked, since all its counts change.
+#ifdef COUNTS_ON
+		first = 0;
+#else
+		first = d > 2 ? d - 2 : 0;
+#endif
+		for(k = first; k < d; k++){
+			LOCK(cb_lock(path[k]));
+			if(cb_sons(path[k])[index[k]] != (k + 1 < d ? path[k + 1] : p)) break;
+		}
+		if(k < d){
+			for(; k >= first; k--)
+				UNLOCK(cb_lock(path[k]));
+			retrying();
+		}
+		if(partial) LOCK(cb_lock(p));
+
+		// p can't move now, and any of its leafs tells whether its keys start with the prefix
+		lim = ((cb_branch*)p)->type != TYPE_LEAF && cb_start(p) < bits ? cb_start(p) : bits;
+		l = cb_closest(p, prefix);
+		pos = l ? cb_crit_pos(prefix, l->key) : 0;
+		// in a partial nibble node, the sons matching the prefix have the index of the prefix but for its last shift bits
+		n = partial ? (cb_nibble*)p : NULL;
+		shift = partial ? cb_end(n) - bits : 0;
+		m = 0;
+		if(l && (pos < 0 || pos >= lim) && partial){
+			for(j = 0; j < 16; j++)
+				if(n->son[j] != EMPTY && j >> shift == cb_index(n, prefix) >> shift) m++;
+		}
+		if(!l || (pos >= 0 && pos < lim) || (partial && !m) || (d < 2 && (!partial || m == ((cb_nibble*)p)->count))){
+			if(partial) UNLOCK(cb_lock(p));
+			for(k = d - 1; k >= first; k--)
+				UNLOCK(cb_lock(path[k]));
+			if(!l){
+				retrying();
+			}
+			free(out);
+			return FAIL;
+		}
+
+		if(partial && m < ((cb_nibble*)p)->count){
+#ifdef COUNTS_ON
+			for(j = 0, c = 0; j < 16; j++)
+				if(n->son[j] != EMPTY && j >> shift == cb_index(n, prefix) >> shift) c += n->cnt[j];
+			for(k = 0; k < d; k++)
+				cb_counts(path[k])[index[k]] -= c;
+#endif
+			out->byte = n->byte;
+			out->shift = n->shift;
+			out->count = 0;
+			for(j = 0; j < 16; j++){
+				out->son[j] = EMPTY;
+#ifdef COUNTS_ON
+				out->cnt[j] = 0;
+#endif
+				if(n->son[j] == EMPTY || j >> shift != cb_index(n, prefix) >> shift) continue;
+				out->son[j] = n->son[j];
+#ifdef COUNTS_ON
+				out->cnt[j] = n->cnt[j];
+				n->cnt[j] = 0;
+#endif
+				out->count++;
+				n->son[j] = EMPTY;
+				n->count--;
+				*subtree = out->son[j];
+			}
+			// only one son is left, so the nibble node collapses into it
+			if(n->count == 1){
+				for(j = 0; j < 16; j++)
+					if(n->son[j] != EMPTY){
+						cb_sons(path[d-1])[index[d-1]] = n->son[j];
+#ifdef COUNTS_ON
+						cb_counts(path[d-1])[index[d-1]] = n->cnt[j];
+#endif
+					}
+				for(j = 0; j < 16; j++)
+					n->son[j] = NULL;
+			}
+			if(out->count > 1){
+				*subtree = out;
+				out = NULL;
+			}
+			UNLOCK(cb_lock(p));
+		}
+		else{
+			// every key below p has the prefix
+#ifdef COUNTS_ON
+			c = cb_counts(path[d-1])[index[d-1]];
+			for(k = 0; k < d; k++)
+				cb_counts(path[k])[index[k]] -= c;
+#endif
+			cb_unlink(path[d-2], index[d-2], path[d-1], index[d-1]);
+			*subtree = p;
+			if(partial) UNLOCK(cb_lock(p));
+		}
+
+		for(k = d - 1; k >= first; k--)
+			UNLOCK(cb_lock(path[k]));
+		free(out);
+		/* TODO: Garbage Collection
+		 * The nodes unlinked here can't be freed either, but the subtree goes to the caller.
+		 */
 		return SUCCESS;
 	}
 }
 
+int cb_remove_prefix(uint8_t *prefix, int bits, void **subtree, uint32_t *retries){
+	return cb_detach_prefix(critbit, prefix, bits, subtree, retries);
+}
+
+int cb_tree_remove_prefix(cb_tree *t, uint8_t *prefix, int bits, void **subtree, uint32_t *retries){
+	return cb_detach_prefix(t, prefix, bits, subtree, retries);
+}
+
+// Hangs in t the subtree y, taken out of the tree from. Where the keys below y differ from t's before y's first bit, its sons are hung one by one.
+// Whatever can't be hung in t, because its key is already there or memory ran out, is hung back in from, and FAIL is returned.
+static int cb_graft(cb_tree *t, void *y, cb_tree *from, uint32_t *retries){
+	cb_leaf *l, *found;
+	int i, r;
+
+	if(y == EMPTY) return SUCCESS;
+	while(!(l = cb_edge(y, 1))){
+		if(retries)(*retries)++;
+	}
+	r = cb_insert_node(t, y, l->key, &found, retries);
+	if(r == FAIL && from) cb_graft(from, y, NULL, retries);
+	if(r != DIVERGES) return r;
+	for(i = 0; i < cb_nsons(y); i++)
+		if(cb_graft(t, cb_sons(y)[i], from, retries) == FAIL) r = FAIL;
+	return r == FAIL ? FAIL : SUCCESS;
+}
+
+// Hangs every son of p, a half of the tree from, in t, except the first leaf, which is from's initial leaf.
+static int cb_graft_half(cb_tree *t, void *p, cb_tree *from, uint32_t *retries){
+	void *first;
+	int i, status = SUCCESS;
+	while(((cb_branch*)p)->type != TYPE_LEAF){
+		first = NULL;
+		for(i = 0; i < cb_nsons(p); i++){
+			if(cb_sons(p)[i] == EMPTY) continue;
+			if(!first) first = cb_sons(p)[i];
+			else if(cb_graft(t, cb_sons(p)[i], from, retries) == FAIL) status = FAIL;
+		}
+		p = first;
+	}
+	return status;
+}
+
+// Moves every key of b into t. b is left with its initial leafs first, so the keys that can't move are hung back in it.
+static int cb_graft_halves(cb_tree *t, cb_tree *b, uint32_t *retries){
+	void *half;
+	cb_leaf *first;
+	int h, status = SUCCESS;
+	for(h = 0; h < 2; h++){
+		while(1){
+			LOCK(&(b->root->lock));
+			half = b->root->son[h];
+			if((first = cb_edge(half, 1))) break;
+			UNLOCK(&(b->root->lock));
+			if(retries)(*retries)++;
+		}
+		b->root->son[h] = first;
+#ifdef COUNTS_ON
+		b->root->cnt[h] = 1;
+#endif
+		UNLOCK(&(b->root->lock));
+		if(cb_graft_half(t, half, b, retries) == FAIL) status = FAIL;
+	}
+	return status;
+}
+
+// Every key after key differs from it first at a bit where key has a 0 and the other key a 1, and only the bits tested along key's path, or the one where it leaves the tree, can have such keys.
+// So the keys moving out are the ones starting with those prefixes, and key itself. Each prefix is detached like cb_remove_prefix() does and hung in the new tree.
+// The half of the tree after the initial leaf in the middle, if it all moves, is swapped whole with the new tree's.
+cb_tree* cb_split(cb_tree *t, uint8_t *key, uint32_t *retries){
+	cb_tree *r = cb_new();
+	uint8_t prefix[KEYLEN];
+	int bits[MAX_PATH + 1];
+	void *p, *f, *sub;
+	cb_leaf *l;
+	int pos, n, j, k, status = SUCCESS;
+
+	if(!r) return NULL;
+
+	if(!(key[0] & 0x80)){
+		LOCK(&(t->root->lock));
+		p = t->root->son[1];
+		t->root->son[1] = r->root->son[1];
+		r->root->son[1] = p;
+#ifdef COUNTS_ON
+		r->root->cnt[1] = t->root->cnt[1];
+		t->root->cnt[1] = 1;
+#endif
+		UNLOCK(&(t->root->lock));
+	}
+
+	while(1){
+		l = cb_closest(t->root, key);
+		if(!l){
+			retrying();
+		}
+		pos = cb_crit_pos(key, l->key);
+		if(pos < 0) pos = KEYLEN*8;
+
+		n = 0;
+		f = NULL;
+		p = t->root;
+		// Where key's son in a nibble node is empty, cb_closest() took another one, so key may leave the tree at any bit of the nibble.
+		while(p && p != EMPTY && ((cb_branch*)p)->type != TYPE_LEAF && (cb_start(p) < pos || (((cb_branch*)p)->type == TYPE_NIBBLE && cb_start(p) == pos))){
+			// the root's bit was handled by the swap
+			for(k = cb_start(p) > 0 ? cb_start(p) : 1; k < cb_end(p); k++)
+				if(!((key[k >> 3] << (k & 7)) & 0x80)) bits[n++] = k;
+			f = p;
+			p = cb_sons(p)[cb_index(p, key)];
+		}
+		if(!p){
+			retrying();
+		}
+		// As in cb_neighbor(), a leaf below where the walk stopped must still tell key apart at pos, or inside the nibble node whose son for key is empty.
+		l = cb_closest(p == EMPTY ? f : p, key);
+		if(!l || (p == EMPTY ? cb_crit_pos(key, l->key) < cb_start(f) || pos >= cb_end(f) : cb_crit_pos(key, l->key) != (pos < KEYLEN*8 ? pos : -1))){
+			retrying();
+		}
+		break;
+	}
+	if(pos == KEYLEN*8 || ((n == 0 || bits[n-1] < pos) && !((key[pos >> 3] << (pos & 7)) & 0x80))) bits[n++] = pos;
+
+	// a subtree that can't be hung in r goes back to t
+	for(j = 0; j < n; j++){
+		memcpy(prefix, key, KEYLEN);
+		if(bits[j] < KEYLEN*8) prefix[bits[j] >> 3] |= 0x80 >> (bits[j] & 7);
+		if(cb_detach_prefix(t, prefix, bits[j] < KEYLEN*8 ? bits[j] + 1 : KEYLEN*8, &sub, retries) == SUCCESS && cb_graft(r, sub, t, retries) == FAIL)
+			status = FAIL;
+	}
+	// then so do the keys that had moved, and t is left as if it wasn't split. r is then left with only its initial leafs, or t's after the swap.
+	if(status == FAIL){
+		if(cb_graft_halves(t, r, retries) == SUCCESS){
+			free(r->root->son[0]);
+			free(r->root->son[1]);
+			free(r->root);
+			free(r);
+		}
+		return NULL;
+	}
+	return r;
+}
+
+// b's nodes are hung in a as they are, except along the paths to b's initial leafs, whose sons are hung one by one.
+int cb_merge(cb_tree *a, cb_tree *b, uint32_t *retries){
+	uint8_t key[KEYLEN];
+	cb_leaf *lo, *hi, *l;
+
+	memset(key, 0, KEYLEN);
+	lo = cb_neighbor(b, key, 1, 0, retries);
+	if(!lo) return SUCCESS;
+	memset(key, 0xFF, KEYLEN);
+	hi = cb_neighbor(b, key, 0, 0, retries);
+	// a can't have keys between b's first and last ones
+	l = cb_neighbor(a, lo->key, 1, 0, retries);
+	if(l && memcmp(l->key, hi->key, KEYLEN) <= 0) return FAIL;
+
+	return cb_graft_halves(a, b, retries);
+}
+
 void _cb_print(void *p, uint64_t *n_nodes, uint64_t *n_objs, int _tab){
 	
-	if(!p) return;
+	if(!p || p == EMPTY) return;
 
 	cb_branch *n;
 //	cb_leaf *o;
@@ -317,7 +1476,7 @@ void _cb_print(void *p, uint64_t *n_nodes, uint64_t *n_objs, int _tab){
 	for(;tab>0;tab--)
 		printf("\t");
 */
-	if(((cb_branch*)p)->type == TYPE_BRANCH){
+	if(((cb_branch*)p)->type != TYPE_LEAF){
 		//(*n_nodes)++;
 		n = (cb_branch*)p;
 /*
@@ -327,8 +1486,8 @@ void _cb_print(void *p, uint64_t *n_nodes, uint64_t *n_objs, int _tab){
 //		printf("bitmask: %s, ", bin_print(n->bitmask));
 		printf("son[0]: %p, son[1]: %p\n", n->son[0], n->son[1]);
 */
-		for(i=0; i<2; i++)
-			_cb_print(n->son[i], n_nodes, n_objs, _tab+1);
+		for(i=0; i<cb_nsons(n); i++)
+			_cb_print(cb_sons(n)[i], n_nodes, n_objs, _tab+1);
 	}
 	else{
 		(*n_objs)++;
@@ -4,27 +4,51 @@
 #include <stdint.h>
 #include <pthread.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define KEYLEN 32 // 256 bits
 
 #define TYPE_BRANCH 0
 #define TYPE_LEAF 1
+#define TYPE_NIBBLE 2
 
 #define SUCCESS 1
 #define FAIL 0
 
+// Compiling every file with -DCOUNTS_ON keeps the number of leafs below each son, for cb_rank(), cb_select() and cb_range_count().
+// Insertions and removals then lock their whole path hand over hand, so trees built without it pay nothing.
+
 // branch node
 typedef struct cb_branch{
-	uint8_t		type:1;		// node type (branch or leaf)
+	uint8_t		type:2;		// node type (branch, nibble or leaf)
 	uint8_t		byte:5; 	// which key byte defines the sons' direction
 	uint8_t		bitmask; 	// which bit in the key bite defines the sons' direction
 //	pthread_mutex_t lock;		// in case you want to use mutex instead
 	pthread_spinlock_t lock;	// node's lock
 	void*		son[2];		// 2 sons
+#ifdef COUNTS_ON
+	uint64_t	cnt[2];		// number of leafs below each son
+#endif
 } cb_branch;
 
+// nibble node, replacing a run of branches that test bits of the same half byte
+typedef struct cb_nibble{
+	uint8_t		type:2;		// node type (branch, nibble or leaf)
+	uint8_t		byte:5;		// which key byte holds the nibble
+	uint8_t		shift;		// 4 for the high nibble, 0 for the low one
+	uint8_t		count;		// number of sons that aren't EMPTY
+	pthread_spinlock_t lock;	// node's lock
+	void*		son[16];	// 16 sons, one for each nibble value
+#ifdef COUNTS_ON
+	uint64_t	cnt[16];	// number of leafs below each son
+#endif
+} cb_nibble;
+
 // leaf node
 typedef struct cb_leaf{
-	uint8_t		type:1;		// node type (branch or leaf)
+	uint8_t		type:2;		// node type (branch, nibble or leaf)
 	uint8_t		key[KEYLEN];	// leaf's key
 	void		*data;		// Pointer to attach your data
 } cb_leaf;
@@ -35,7 +59,17 @@ typedef struct{
 } cb_tree;
 
 // the tree
-cb_tree *critbit;
+extern cb_tree *critbit;
+
+// marks the unused sons of a nibble node (NULL marks the sons of removed nodes)
+extern cb_leaf cb_empty;
+#define EMPTY ((void*)&cb_empty)
+
+// sons of a branch or nibble node, and how many they are
+#define cb_sons(p)\
+	(((cb_branch*)(p))->type == TYPE_BRANCH ? ((cb_branch*)(p))->son : ((cb_nibble*)(p))->son)
+#define cb_nsons(p)\
+	(((cb_branch*)(p))->type == TYPE_BRANCH ? 2 : 16)
 
 // initializes the mask table
 void
@@ -49,18 +83,133 @@ cb_crit_bit(cb_leaf *o1, cb_leaf *o2, cb_branch *n);
 void 
 cb_init();
 
+// creates another, empty, tree. The cb_tree_* functions below work on any tree, and the ones without a tree argument on critbit.
+cb_tree*
+cb_new();
+
 // inserts a leaf node into the tree
 cb_leaf* 
 cb_insert(cb_leaf *obj, uint32_t *retries);
 
+// inserts a leaf node into the tree, or returns the leaf already holding its key.
+// When the leaf returned isn't leaf, leaf wasn't inserted and is still the caller's to free.
+cb_leaf*
+cb_get_or_insert(cb_leaf *leaf, uint32_t *retries);
+
+// inserts a leaf node into the tree or, if its key is already there, atomically moves its data into the existing leaf.
+// Returns the leaf holding the key; old receives the data replaced, if any. When that leaf isn't leaf, leaf is still the caller's to free, but its data now belongs to the tree.
+cb_leaf*
+cb_upsert(cb_leaf *leaf, void **old, uint32_t *retries);
+
+// atomically replaces the data of a leaf if it still is expected
+int
+cb_cas_data(uint8_t *key, void *expected, void *desired, uint32_t *retries);
+
 // finds a leaf node in the tree
 cb_leaf* 
 cb_find(uint8_t *key, uint32_t *retries);
 
+// finds the leaf with the smallest key greater than or equal to key.
+// Keys are ordered like memcmp() orders them. Under concurrent insertions and removals, the leaf returned was in the tree at some point during the call.
+cb_leaf*
+cb_ceil(uint8_t *key, uint32_t *retries);
+
+// finds the leaf with the largest key less than or equal to key
+cb_leaf*
+cb_floor(uint8_t *key, uint32_t *retries);
+
+// finds the leafs with the smallest and the largest keys
+cb_leaf*
+cb_min(uint32_t *retries);
+
+cb_leaf*
+cb_max(uint32_t *retries);
+
 // removes a leaf node from the tree
 int 
 cb_remove(uint8_t *key, uint32_t *retries);
 
+// removes every key starting with the first bits of prefix at once, unlinking the subtree that holds them.
+// subtree receives its top node, from which its leafs can still be visited. Returns FAIL if no key has the prefix, or if the initial leafs' keys have it.
+int
+cb_remove_prefix(uint8_t *prefix, int bits, void **subtree, uint32_t *retries);
+
+// moves every key greater than or equal to key out of t, into a new tree that is returned, without copying the nodes.
+// t may be in use meanwhile. Operations already inside the subtrees that move may still finish there, as if they had happened before the split.
+// Returns NULL if memory runs out, after moving back into t the keys that had already moved.
+cb_tree*
+cb_split(cb_tree *t, uint8_t *key, uint32_t *retries);
+
+// moves every key of b into a, without copying the nodes, leaving b empty.
+// Returns FAIL, changing nothing, if a has a key between b's smallest and largest ones. b can't be in use meanwhile, and a can't get keys in that range.
+// Also returns FAIL if memory runs out, leaving in b the keys that couldn't move.
+int
+cb_merge(cb_tree *a, cb_tree *b, uint32_t *retries);
+
+// The functions above without a tree argument, on a given tree
+cb_leaf*
+cb_tree_insert(cb_tree *t, cb_leaf *leaf, uint32_t *retries);
+
+cb_leaf*
+cb_tree_get_or_insert(cb_tree *t, cb_leaf *leaf, uint32_t *retries);
+
+cb_leaf*
+cb_tree_upsert(cb_tree *t, cb_leaf *leaf, void **old, uint32_t *retries);
+
+int
+cb_tree_cas_data(cb_tree *t, uint8_t *key, void *expected, void *desired, uint32_t *retries);
+
+cb_leaf*
+cb_tree_find(cb_tree *t, uint8_t *key, uint32_t *retries);
+
+// like cb_ceil() and cb_floor(), leaving key itself out if strict
+cb_leaf*
+cb_tree_ceil(cb_tree *t, uint8_t *key, int strict, uint32_t *retries);
+
+cb_leaf*
+cb_tree_floor(cb_tree *t, uint8_t *key, int strict, uint32_t *retries);
+
+cb_leaf*
+cb_tree_min(cb_tree *t, uint32_t *retries);
+
+cb_leaf*
+cb_tree_max(cb_tree *t, uint32_t *retries);
+
+int
+cb_tree_remove(cb_tree *t, uint8_t *key, uint32_t *retries);
+
+// removes the leaf holding key and returns it, or NULL if there's none. Readers may still be inside it, so it's up to the caller when to free it.
+cb_leaf*
+cb_tree_take(cb_tree *t, uint8_t *key, uint32_t *retries);
+
+int
+cb_tree_remove_prefix(cb_tree *t, uint8_t *prefix, int bits, void **subtree, uint32_t *retries);
+
+#ifdef COUNTS_ON
+// number of keys smaller than key.
+// The counts are read without locks, so under concurrent insertions and removals the answer is only approximate. It is exact once they stop.
+uint64_t
+cb_rank(uint8_t *key, uint32_t *retries);
+
+// finds the leaf holding the k-th smallest key, counting from 0, or returns NULL if there are no more than k keys
+cb_leaf*
+cb_select(uint64_t k, uint32_t *retries);
+
+// number of keys greater than or equal to lo and smaller than hi
+uint64_t
+cb_range_count(uint8_t *lo, uint8_t *hi, uint32_t *retries);
+
+// the functions above on a given tree
+uint64_t
+cb_tree_rank(cb_tree *t, uint8_t *key, uint32_t *retries);
+
+cb_leaf*
+cb_tree_select(cb_tree *t, uint64_t k, uint32_t *retries);
+
+uint64_t
+cb_tree_range_count(cb_tree *t, uint8_t *lo, uint8_t *hi, uint32_t *retries);
+#endif
+
 // prints the tree and returns the numbers of leafs
 uint64_t 
 cb_print(void *p);
@@ -69,4 +218,8 @@ cb_print(void *p);
 void 
 _cb_print(void *p, uint64_t *n_nodes, uint64_t *n_objs, int _tab);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
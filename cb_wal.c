@@ -0,0 +1,442 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <pthread.h>
+
+#include "cb_wal.h"
+
+// a record is: payload length (4 bytes), operation (1 byte), key, payload and checksum (4 bytes)
+#define WAL_HEADER (sizeof(uint32_t) + 1)
+#define WAL_RECORD(len) (WAL_HEADER + KEYLEN + (len) + sizeof(uint32_t))
+
+// the write-ahead log. Records are appended to buf and written by a single leader thread, whose fdatasync() covers every record appended before it started (group commit).
+typedef struct{
+	int		fd;		// current log file
+	char		*log_path;	// path.log
+	char		*old_path;	// path.log.old, the log being replaced by a checkpoint
+	char		*ckpt_path;	// path.ckpt
+	char		*tmp_path;	// path.ckpt.tmp
+	char		*dir_path;	// directory holding the files, synced after renames
+	cb_wal_data_size data_size;	// payload size callback
+	pthread_mutex_t	mutex;		// protects everything below
+	pthread_cond_t	cond;		// signaled when a flush ends
+	uint8_t		*buf;		// records waiting to be written
+	size_t		len, cap;
+	uint8_t		*spare;		// buffer being written by the leader
+	size_t		spare_cap;
+	uint64_t	next_lsn;	// end of the last appended record
+	uint64_t	durable_lsn;	// end of the last durable record
+	int		flushing;	// a leader is writing
+	int		failed;		// a write failed, the log is unusable
+	pthread_mutex_t	ckpt_lock;	// one checkpoint at a time
+	pthread_mutex_t	stripe[WAL_STRIPES];	// keeps tree and log order the same for each key
+} cb_wal;
+
+static cb_wal wal;
+
+// FNV-1a, used both for checksums and for choosing key stripes
+static uint32_t wal_hash(uint32_t h, const uint8_t *p, size_t n){
+	while(n--){
+		h ^= *p++;
+		h *= 16777619;
+	}
+	return h;
+}
+
+#define wal_stripe(key)\
+	(&wal.stripe[wal_hash(2166136261u, (key), KEYLEN) & (WAL_STRIPES - 1)])
+
+static char *wal_path(const char *path, const char *suffix){
+	char *p = (char*) malloc(strlen(path) + strlen(suffix) + 1);
+	if(p) sprintf(p, "%s%s", path, suffix);
+	return p;
+}
+
+// serializes a record into dst, which must hold WAL_RECORD(len) bytes
+static void wal_encode(uint8_t *dst, uint8_t op, uint8_t *key, void *data, uint32_t len){
+	uint32_t sum;
+	memcpy(dst, &len, sizeof(uint32_t));
+	dst[sizeof(uint32_t)] = op;
+	memcpy(dst + WAL_HEADER, key, KEYLEN);
+	if(len) memcpy(dst + WAL_HEADER + KEYLEN, data, len);
+	sum = wal_hash(2166136261u, dst, WAL_HEADER + KEYLEN + len);
+	memcpy(dst + WAL_HEADER + KEYLEN + len, &sum, sizeof(uint32_t));
+}
+
+static int wal_write(int fd, uint8_t *p, size_t n){
+	ssize_t w;
+	while(n){
+		w = write(fd, p, n);
+		if(w < 0){
+			if(errno == EINTR) continue;
+			return FAIL;
+		}
+		p += w;
+		n -= w;
+	}
+	return SUCCESS;
+}
+
+static int wal_sync_dir(){
+	int fd = open(wal.dir_path, O_RDONLY);
+	if(fd < 0) return FAIL;
+	int ret = fsync(fd) ? FAIL : SUCCESS;
+	close(fd);
+	return ret;
+}
+
+// appends a record to the buffer and returns its lsn, or 0 if the buffer couldn't grow, which leaves the log failed. Must be called with the mutex held.
+static uint64_t wal_append(uint8_t op, uint8_t *key, void *data, uint32_t len){
+	size_t n = WAL_RECORD(len);
+	if(wal.len + n > wal.cap){
+		size_t cap = wal.cap ? wal.cap : 4096;
+		while(cap < wal.len + n) cap *= 2;
+		uint8_t *buf = (uint8_t*) realloc(wal.buf, cap);
+		if(!buf){
+			wal.failed = 1;
+			return 0;
+		}
+		wal.buf = buf;
+		wal.cap = cap;
+	}
+	wal_encode(wal.buf + wal.len, op, key, data, len);
+	wal.len += n;
+	wal.next_lsn += n;
+	return wal.next_lsn;
+}
+
+// takes the pending records for writing and makes this thread the leader. Must be called with the mutex held and no flush running.
+static size_t wal_lead(uint64_t *target){
+	uint8_t *p = wal.spare;
+	size_t cap = wal.spare_cap, n = wal.len;
+	wal.spare = wal.buf;
+	wal.spare_cap = wal.cap;
+	wal.buf = p;
+	wal.cap = cap;
+	wal.len = 0;
+	wal.flushing = 1;
+	*target = wal.next_lsn;
+	return n;
+}
+
+// ends a flush started by wal_lead(). Must be called with the mutex held.
+static void wal_follow(int ok, uint64_t target){
+	if(ok) wal.durable_lsn = target;
+	else wal.failed = 1;
+	wal.flushing = 0;
+	pthread_cond_broadcast(&wal.cond);
+}
+
+// waits until the record ending at lsn is durable. The first waiter finding no flush running writes everything appended so far, so a single fdatasync() serves all the threads that appended meanwhile.
+static int wal_commit(uint64_t lsn){
+	uint64_t target;
+	size_t n;
+	int ok;
+
+	pthread_mutex_lock(&wal.mutex);
+	while(wal.durable_lsn < lsn && !wal.failed){
+		if(wal.flushing){
+			pthread_cond_wait(&wal.cond, &wal.mutex);
+			continue;
+		}
+		n = wal_lead(&target);
+		pthread_mutex_unlock(&wal.mutex);
+
+		ok = wal_write(wal.fd, wal.spare, n) && !fdatasync(wal.fd);
+
+		pthread_mutex_lock(&wal.mutex);
+		wal_follow(ok, target);
+	}
+	ok = wal.durable_lsn >= lsn;
+	pthread_mutex_unlock(&wal.mutex);
+	return ok ? SUCCESS : FAIL;
+}
+
+// inserts or replaces a key while replaying. Recovery runs alone, so the payload replaced is one allocated by an earlier record.
+static int wal_redo_insert(uint8_t *key, uint8_t *data, uint32_t len){
+	void *copy = NULL;
+	if(len){
+		copy = malloc(len);
+		if(!copy) return FAIL;
+		memcpy(copy, data, len);
+	}
+
+	cb_leaf *leaf = cb_find(key, NULL);
+	if(leaf){
+		free(leaf->data);
+		leaf->data = copy;
+		return SUCCESS;
+	}
+
+	leaf = (cb_leaf*) malloc(sizeof(cb_leaf));
+	if(!leaf){
+		free(copy);
+		return FAIL;
+	}
+	memcpy(leaf->key, key, KEYLEN);
+	leaf->data = copy;
+	if(!cb_insert(leaf, NULL)){
+		free(copy);
+		free(leaf);
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+// replays every valid record of a file. A torn or corrupted record ends the replay, and its offset is returned in end.
+static int wal_replay(const char *path, off_t *end){
+	uint8_t *rec = NULL;
+	uint32_t len, sum;
+	size_t cap = 0, n;
+	int ret = SUCCESS;
+
+	*end = 0;
+	FILE *f = fopen(path, "rb");
+	if(!f) return errno == ENOENT ? SUCCESS : FAIL;
+
+	while(1){
+		uint8_t header[WAL_HEADER];
+		if(fread(header, 1, WAL_HEADER, f) != WAL_HEADER) break;
+		memcpy(&len, header, sizeof(uint32_t));
+		// a length no record can have comes from a torn header
+		if(len > WAL_MAX_DATA) break;
+		n = WAL_RECORD(len);
+		if(n > cap){
+			uint8_t *p = (uint8_t*) realloc(rec, n);
+			if(!p){
+				ret = FAIL;
+				break;
+			}
+			rec = p;
+			cap = n;
+		}
+		memcpy(rec, header, WAL_HEADER);
+		if(fread(rec + WAL_HEADER, 1, n - WAL_HEADER, f) != n - WAL_HEADER) break;
+		memcpy(&sum, rec + n - sizeof(uint32_t), sizeof(uint32_t));
+		if(sum != wal_hash(2166136261u, rec, n - sizeof(uint32_t))) break;
+
+		if(rec[sizeof(uint32_t)] == WAL_INSERT){
+			if(wal_redo_insert(rec + WAL_HEADER, rec + WAL_HEADER + KEYLEN, len) == FAIL){
+				ret = FAIL;
+				break;
+			}
+		}
+		else if(rec[sizeof(uint32_t)] == WAL_REMOVE)
+			cb_remove(rec + WAL_HEADER, NULL);
+		else break;
+		*end += n;
+	}
+
+	free(rec);
+	fclose(f);
+	return ret;
+}
+
+int cb_wal_open(const char *path, cb_wal_data_size data_size){
+	off_t end;
+	int i;
+
+	memset(&wal, 0, sizeof(cb_wal));
+	wal.fd = -1;
+	wal.data_size = data_size;
+	wal.log_path = wal_path(path, ".log");
+	wal.old_path = wal_path(path, ".log.old");
+	wal.ckpt_path = wal_path(path, ".ckpt");
+	wal.tmp_path = wal_path(path, ".ckpt.tmp");
+	if(!wal.log_path || !wal.old_path || !wal.ckpt_path || !wal.tmp_path)
+		return FAIL;
+	char *dir = wal_path(path, "");
+	if(!dir) return FAIL;
+	wal.dir_path = wal_path(dirname(dir), "");
+	free(dir);
+	if(!wal.dir_path) return FAIL;
+
+	pthread_mutex_init(&wal.mutex, NULL);
+	pthread_cond_init(&wal.cond, NULL);
+	pthread_mutex_init(&wal.ckpt_lock, NULL);
+	for(i = 0; i < WAL_STRIPES; i++)
+		pthread_mutex_init(&wal.stripe[i], NULL);
+
+	// Recovery. The checkpoint was taken after the old log was closed, so replaying the old log over it only rewrites values the checkpoint already holds.
+	if(wal_replay(wal.ckpt_path, &end) == FAIL) return FAIL;
+	if(wal_replay(wal.old_path, &end) == FAIL) return FAIL;
+	if(wal_replay(wal.log_path, &end) == FAIL) return FAIL;
+
+	wal.fd = open(wal.log_path, O_WRONLY | O_CREAT, 0644);
+	if(wal.fd < 0) return FAIL;
+	// drops a torn tail left by a crash, so new records follow the last valid one
+	if(ftruncate(wal.fd, end) || lseek(wal.fd, end, SEEK_SET) < 0 || fdatasync(wal.fd)){
+		close(wal.fd);
+		wal.fd = -1;
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+int cb_wal_close(){
+	int ret;
+	pthread_mutex_lock(&wal.mutex);
+	uint64_t lsn = wal.next_lsn;
+	pthread_mutex_unlock(&wal.mutex);
+
+	ret = wal_commit(lsn);
+	if(wal.fd >= 0 && close(wal.fd)) ret = FAIL;
+	wal.fd = -1;
+
+	free(wal.buf);
+	free(wal.spare);
+	free(wal.log_path);
+	free(wal.old_path);
+	free(wal.ckpt_path);
+	free(wal.tmp_path);
+	free(wal.dir_path);
+	return ret;
+}
+
+// tells whether a write failed, after which nothing more is logged
+static int wal_broken(){
+	int failed;
+	pthread_mutex_lock(&wal.mutex);
+	failed = wal.failed;
+	pthread_mutex_unlock(&wal.mutex);
+	return failed;
+}
+
+cb_leaf* cb_wal_insert(cb_leaf *leaf, uint32_t *retries){
+	size_t len = (leaf->data && wal.data_size) ? wal.data_size(leaf->data) : 0;
+	pthread_mutex_t *stripe = wal_stripe(leaf->key);
+	uint64_t lsn;
+
+	if(len > WAL_MAX_DATA || wal_broken()) return NULL;
+
+	// The record must be appended while the stripe is held, otherwise a concurrent remove of the same key could reach the log first.
+	pthread_mutex_lock(stripe);
+	if(!cb_insert(leaf, retries)){
+		pthread_mutex_unlock(stripe);
+		return NULL;
+	}
+	// lsn 0 means the record couldn't be appended, so nothing was logged
+	pthread_mutex_lock(&wal.mutex);
+	lsn = wal.failed ? 0 : wal_append(WAL_INSERT, leaf->key, leaf->data, len);
+	pthread_mutex_unlock(&wal.mutex);
+	pthread_mutex_unlock(stripe);
+
+	return lsn && wal_commit(lsn) ? leaf : NULL;
+}
+
+int cb_wal_remove(uint8_t *key, uint32_t *retries){
+	pthread_mutex_t *stripe = wal_stripe(key);
+	uint64_t lsn;
+
+	if(wal_broken()) return FAIL;
+
+	pthread_mutex_lock(stripe);
+	if(cb_remove(key, retries) == FAIL){
+		pthread_mutex_unlock(stripe);
+		return FAIL;
+	}
+	pthread_mutex_lock(&wal.mutex);
+	lsn = wal.failed ? 0 : wal_append(WAL_REMOVE, key, NULL, 0);
+	pthread_mutex_unlock(&wal.mutex);
+	pthread_mutex_unlock(stripe);
+
+	return lsn ? wal_commit(lsn) : FAIL;
+}
+
+// Writes every leaf of the tree as an insert record.
+// A recursive walk of the live tree could miss keys that a concurrent removal or promotion moves above it, so each leaf is found again from the root as the successor of the previous one.
+static int wal_snapshot(cb_tree *t, FILE *f){
+	uint8_t key[KEYLEN], *rec = NULL, *r;
+	size_t n, cap = 0;
+	uint32_t len;
+	cb_leaf *leaf;
+	void *data;
+	int ret = SUCCESS;
+
+	memset(key, 0, KEYLEN);
+	leaf = cb_tree_ceil(t, key, 0, NULL);
+	while(leaf){
+		data = leaf->data;
+		len = (data && wal.data_size) ? wal.data_size(data) : 0;
+		n = WAL_RECORD(len);
+		if(n > cap){
+			r = (uint8_t*) realloc(rec, n);
+			if(!r){
+				ret = FAIL;
+				break;
+			}
+			rec = r;
+			cap = n;
+		}
+		wal_encode(rec, WAL_INSERT, leaf->key, data, len);
+		if(fwrite(rec, 1, n, f) != n){
+			ret = FAIL;
+			break;
+		}
+		memcpy(key, leaf->key, KEYLEN);
+		leaf = cb_tree_ceil(t, key, 1, NULL);
+	}
+	free(rec);
+	return ret;
+}
+
+// Fuzzy checkpoint. The log is first closed and renamed to path.log.old, and writers continue on a new log. The snapshot then walks the live tree, so it may or may not see the operations logged after the switch, which recovery replays anyway.
+int cb_wal_checkpoint(){
+	uint64_t target;
+	size_t n;
+	int ok, fd;
+
+	pthread_mutex_lock(&wal.ckpt_lock);
+
+	// switches logs as the flush leader, so no other thread writes meanwhile
+	pthread_mutex_lock(&wal.mutex);
+	while(wal.flushing)
+		pthread_cond_wait(&wal.cond, &wal.mutex);
+	if(wal.failed){
+		pthread_mutex_unlock(&wal.mutex);
+		pthread_mutex_unlock(&wal.ckpt_lock);
+		return FAIL;
+	}
+	n = wal_lead(&target);
+	pthread_mutex_unlock(&wal.mutex);
+
+	ok = wal_write(wal.fd, wal.spare, n) && !fdatasync(wal.fd);
+	// If the previous checkpoint failed midway its old log is still needed, so this one keeps the current log instead of switching.
+	if(ok && access(wal.old_path, F_OK)){
+		ok = !rename(wal.log_path, wal.old_path);
+		if(ok){
+			fd = open(wal.log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			ok = fd >= 0 && wal_sync_dir();
+			if(ok){
+				close(wal.fd);
+				wal.fd = fd;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&wal.mutex);
+	wal_follow(ok, target);
+	pthread_mutex_unlock(&wal.mutex);
+	if(!ok){
+		pthread_mutex_unlock(&wal.ckpt_lock);
+		return FAIL;
+	}
+
+	// writes the snapshot aside and only then replaces the previous checkpoint
+	FILE *f = fopen(wal.tmp_path, "wb");
+	ok = f != NULL;
+	if(ok){
+		ok = wal_snapshot(critbit, f) && !fflush(f) && !fsync(fileno(f));
+		if(fclose(f)) ok = 0;
+	}
+	if(ok) ok = !rename(wal.tmp_path, wal.ckpt_path) && wal_sync_dir();
+	if(ok) ok = !unlink(wal.old_path) || errno == ENOENT;
+
+	pthread_mutex_unlock(&wal.ckpt_lock);
+	return ok ? SUCCESS : FAIL;
+}
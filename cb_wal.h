@@ -0,0 +1,41 @@
+#ifndef CB_WAL_H
+#define CB_WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cb_tree.h"
+
+#define WAL_INSERT 1
+#define WAL_REMOVE 2
+
+#define WAL_STRIPES 1024	// key stripes ordering same-key operations in the log (power of 2)
+#define WAL_MAX_DATA (1 << 24)	// largest payload that can be logged. Replay takes a longer record for a torn one.
+
+// returns the size of the payload attached to leaf->data, so it can be logged
+typedef size_t (*cb_wal_data_size)(void *data);
+
+// opens the log at path (creating it if needed) and replays the checkpoint and the log into the tree.
+// cb_init() must be called first. data_size may be NULL, in which case payloads are not logged.
+int
+cb_wal_open(const char *path, cb_wal_data_size data_size);
+
+// flushes pending records and closes the log
+int
+cb_wal_close();
+
+// inserts a leaf node into the tree and returns only after the insertion is durable. Later changes to leaf->data are not logged.
+// Returns NULL if the key is already in the tree, if the payload is larger than WAL_MAX_DATA, or if the log could not be written (the leaf then stays in the tree).
+cb_leaf*
+cb_wal_insert(cb_leaf *leaf, uint32_t *retries);
+
+// removes a leaf node from the tree and returns only after the removal is durable.
+// Returns FAIL if the key isn't in the tree, or if the log could not be written (the key then stays removed).
+int
+cb_wal_remove(uint8_t *key, uint32_t *retries);
+
+// writes a snapshot of the tree and discards the log records it covers
+int
+cb_wal_checkpoint();
+
+#endif
@@ -0,0 +1,412 @@
+#ifndef CRITBIT_MAP_HPP
+#define CRITBIT_MAP_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "cb_tree.h"
+
+// Key traits turn a key into size bytes, ordered like the keys when compared with memcmp(), and back.
+template<typename Key, typename Enable = void>
+struct critbit_key_traits;
+
+// integers, most significant byte first, with the sign bit flipped so that negative numbers come first
+template<typename Key>
+struct critbit_key_traits<Key, typename std::enable_if<std::is_integral<Key>::value && !std::is_same<Key, bool>::value>::type>{
+	typedef typename std::make_unsigned<Key>::type bits;
+	static constexpr std::size_t size = sizeof(Key);
+
+	static void encode(const Key &key, uint8_t *bytes){
+		bits b = (bits)key;
+		if(std::is_signed<Key>::value) b ^= (bits)1 << (8*size - 1);
+		for(std::size_t i = 0; i < size; i++)
+			bytes[i] = (uint8_t)(b >> 8*(size - 1 - i));
+	}
+
+	static Key decode(const uint8_t *bytes){
+		bits b = 0;
+		for(std::size_t i = 0; i < size; i++)
+			b = (bits)(b << 8 | bytes[i]);
+		if(std::is_signed<Key>::value) b ^= (bits)1 << (8*size - 1);
+		return (Key)b;
+	}
+};
+
+// fixed size byte strings, as they are
+template<std::size_t N>
+struct critbit_key_traits<std::array<uint8_t, N> >{
+	static constexpr std::size_t size = N;
+
+	static void encode(const std::array<uint8_t, N> &key, uint8_t *bytes){
+		std::memcpy(bytes, key.data(), N);
+	}
+
+	static std::array<uint8_t, N> decode(const uint8_t *bytes){
+		std::array<uint8_t, N> key;
+		std::memcpy(key.data(), bytes, N);
+		return key;
+	}
+};
+
+// A typed map on its own cb_tree, keeping each value inside its leaf.
+// Like the C functions, it needs cb_init() to have been called. Lookups, insertions, extractions and iterations may run concurrently, but iterations hold no locks, so they see the map as it changes.
+// Leafs taken out can't be freed while readers may still be inside them. erase() and clear() free them at once, so they are up to the caller to keep apart from readers.
+template<typename Key, typename Value, typename KeyTraits = critbit_key_traits<Key>, typename Alloc = std::allocator<Value> >
+class critbit_map{
+	// The keys start with a 1 byte, so none of them is an initial leaf's key, and the rest of KEYLEN stays 0.
+	static constexpr uint8_t TAG = 1;
+	static_assert(KeyTraits::size < KEYLEN, "keys can't take more than KEYLEN - 1 bytes");
+
+	// the tree only sees the cb_leaf part
+	struct node : cb_leaf{
+		Value value;
+
+		template<typename... Args>
+		explicit node(Args&&... args) : value(std::forward<Args>(args)...){}
+	};
+
+	typedef typename std::allocator_traits<Alloc>::template rebind_alloc<node> node_alloc;
+	typedef std::allocator_traits<node_alloc> node_traits;
+
+	static node *to_node(cb_leaf *leaf){
+		return leaf ? static_cast<node*>(leaf) : nullptr;
+	}
+
+	static void encode(const Key &key, uint8_t *bytes){
+		std::memset(bytes, 0, KEYLEN);
+		bytes[0] = TAG;
+		KeyTraits::encode(key, bytes + 1);
+	}
+
+	static void destroy(node_alloc &alloc, node *n){
+		node_traits::destroy(alloc, n);
+		node_traits::deallocate(alloc, n, 1);
+	}
+
+public:
+	template<bool Const>
+	class basic_iterator{
+	public:
+		typedef std::bidirectional_iterator_tag iterator_category;
+		typedef Value value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef typename std::conditional<Const, const Value*, Value*>::type pointer;
+		typedef typename std::conditional<Const, const Value&, Value&>::type reference;
+
+		basic_iterator() : t(nullptr), n(nullptr){}
+		basic_iterator(const basic_iterator<false> &it) : t(it.t), n(it.n){}
+
+		Key key() const{
+			return KeyTraits::decode(n->key + 1);
+		}
+
+		reference operator*() const{
+			return n->value;
+		}
+
+		pointer operator->() const{
+			return &n->value;
+		}
+
+		// the next key is looked up again, so the leaf left behind may have been removed meanwhile
+		basic_iterator &operator++(){
+			n = to_node(cb_tree_ceil(t, n->key, 1, nullptr));
+			return *this;
+		}
+
+		basic_iterator operator++(int){
+			basic_iterator it = *this;
+			++*this;
+			return it;
+		}
+
+		basic_iterator &operator--(){
+			uint8_t key[KEYLEN];
+			if(n) n = to_node(cb_tree_floor(t, n->key, 1, nullptr));
+			else{
+				std::memset(key, 0xFF, KEYLEN);
+				n = to_node(cb_tree_floor(t, key, 0, nullptr));
+			}
+			return *this;
+		}
+
+		basic_iterator operator--(int){
+			basic_iterator it = *this;
+			--*this;
+			return it;
+		}
+
+		friend bool operator==(const basic_iterator &a, const basic_iterator &b){
+			return a.n == b.n;
+		}
+
+		friend bool operator!=(const basic_iterator &a, const basic_iterator &b){
+			return a.n != b.n;
+		}
+
+	private:
+		friend class critbit_map;
+		template<bool> friend class basic_iterator;
+
+		basic_iterator(cb_tree *t, node *n) : t(t), n(n){}
+
+		cb_tree *t;
+		node *n;
+	};
+
+	typedef basic_iterator<false> iterator;
+	typedef basic_iterator<true> const_iterator;
+
+	// Owns a leaf taken out by extract(), which can be inserted again without copying. It frees the leaf if it still has it when destroyed.
+	class node_type{
+	public:
+		node_type() : n(nullptr){}
+
+		node_type(node_type &&nh) noexcept : n(nh.n), alloc(std::move(nh.alloc)){
+			nh.n = nullptr;
+		}
+
+		node_type &operator=(node_type &&nh) noexcept{
+			if(this != &nh){
+				reset();
+				n = nh.n;
+				alloc = std::move(nh.alloc);
+				nh.n = nullptr;
+			}
+			return *this;
+		}
+
+		node_type(const node_type&) = delete;
+		node_type &operator=(const node_type&) = delete;
+
+		~node_type(){
+			reset();
+		}
+
+		bool empty() const{
+			return !n;
+		}
+
+		explicit operator bool() const{
+			return n != nullptr;
+		}
+
+		Key key() const{
+			return KeyTraits::decode(n->key + 1);
+		}
+
+		Value &value() const{
+			return n->value;
+		}
+
+	private:
+		friend class critbit_map;
+
+		node_type(node *n, const node_alloc &alloc) : n(n), alloc(alloc){}
+
+		void reset(){
+			if(n) destroy(alloc, n);
+			n = nullptr;
+		}
+
+		node *n;
+		node_alloc alloc;
+	};
+
+	explicit critbit_map(const Alloc &alloc = Alloc()) : tree(cb_new()), alloc(alloc), nkeys(0){
+		if(!tree) throw std::bad_alloc();
+	}
+
+	critbit_map(const critbit_map&) = delete;
+	critbit_map &operator=(const critbit_map&) = delete;
+
+	~critbit_map(){
+		release(tree->root);
+		std::free(tree);
+	}
+
+	std::size_t size() const{
+		return nkeys.load();
+	}
+
+	bool empty() const{
+		return size() == 0;
+	}
+
+	iterator find(const Key &key){
+		uint8_t bytes[KEYLEN];
+		encode(key, bytes);
+		return iterator(tree, lookup(bytes));
+	}
+
+	const_iterator find(const Key &key) const{
+		uint8_t bytes[KEYLEN];
+		encode(key, bytes);
+		return const_iterator(tree, lookup(bytes));
+	}
+
+	bool contains(const Key &key) const{
+		return find(key) != end();
+	}
+
+	std::size_t count(const Key &key) const{
+		return contains(key) ? 1 : 0;
+	}
+
+	// Builds the value from args and inserts it, unless key is already there. Then the iterator points to the value found, and args are left alone unless another thread inserted the key meanwhile.
+	template<typename... Args>
+	std::pair<iterator, bool> try_emplace(const Key &key, Args&&... args){
+		uint8_t bytes[KEYLEN];
+		node *found, *leaf;
+
+		encode(key, bytes);
+		if((found = lookup(bytes))) return std::make_pair(iterator(tree, found), false);
+
+		leaf = node_traits::allocate(alloc, 1);
+		try{
+			node_traits::construct(alloc, leaf, std::forward<Args>(args)...);
+		}
+		catch(...){
+			node_traits::deallocate(alloc, leaf, 1);
+			throw;
+		}
+		std::memcpy(leaf->key, bytes, KEYLEN);
+		leaf->data = &leaf->value;
+		return insert_leaf(leaf);
+	}
+
+	std::pair<iterator, bool> insert(const Key &key, const Value &value){
+		return try_emplace(key, value);
+	}
+
+	std::pair<iterator, bool> insert(const Key &key, Value &&value){
+		return try_emplace(key, std::move(value));
+	}
+
+	// Inserts the leaf held by nh. If its key is already there, nh keeps it.
+	std::pair<iterator, bool> insert(node_type &&nh){
+		std::pair<iterator, bool> r;
+		if(!nh.n) return std::make_pair(end(), false);
+		r = insert_leaf(nh.n, false);
+		if(r.second) nh.n = nullptr;
+		return r;
+	}
+
+	Value &operator[](const Key &key){
+		return *try_emplace(key).first;
+	}
+
+	// takes key's leaf out of the map, without freeing it
+	node_type extract(const Key &key){
+		uint8_t bytes[KEYLEN];
+		node *leaf;
+
+		encode(key, bytes);
+		if(!(leaf = to_node(cb_tree_take(tree, bytes, nullptr)))) return node_type();
+		nkeys--;
+		return node_type(leaf, alloc);
+	}
+
+	std::size_t erase(const Key &key){
+		return extract(key) ? 1 : 0;
+	}
+
+	void clear(){
+		cb_tree *t = cb_new();
+		if(!t) throw std::bad_alloc();
+		release(tree->root);
+		std::free(tree);
+		tree = t;
+		nkeys = 0;
+	}
+
+	// first key not smaller than key, and first key greater than key
+	iterator lower_bound(const Key &key){
+		return bound(key, 0);
+	}
+
+	iterator upper_bound(const Key &key){
+		return bound(key, 1);
+	}
+
+	iterator begin(){
+		uint8_t key[KEYLEN];
+		std::memset(key, 0, KEYLEN);
+		return iterator(tree, to_node(cb_tree_ceil(tree, key, 0, nullptr)));
+	}
+
+	const_iterator begin() const{
+		return const_cast<critbit_map*>(this)->begin();
+	}
+
+	iterator end(){
+		return iterator(tree, nullptr);
+	}
+
+	const_iterator end() const{
+		return const_iterator(tree, nullptr);
+	}
+
+private:
+	// cb_tree_find(), inlined, comparing only the bytes the keys take. The initial leafs differ from every key in the first byte.
+	node *lookup(const uint8_t *key) const{
+		void *p = tree->root, *s;
+		while(((cb_branch*)p)->type != TYPE_LEAF){
+			if(((cb_branch*)p)->type == TYPE_BRANCH)
+				s = ((cb_branch*)p)->son[(key[((cb_branch*)p)->byte] & ((cb_branch*)p)->bitmask) != 0];
+			else
+				s = ((cb_nibble*)p)->son[(key[((cb_nibble*)p)->byte] >> ((cb_nibble*)p)->shift) & 0xF];
+			if(s == EMPTY) return nullptr;
+			// invalidated by a concurrent removal, so the walk restarts
+			p = s ? s : tree->root;
+		}
+		if(std::memcmp(key, ((cb_leaf*)p)->key, KeyTraits::size + 1)) return nullptr;
+		return static_cast<node*>((cb_leaf*)p);
+	}
+
+	// A leaf that loses the race for its key is freed, unless its caller still owns it.
+	std::pair<iterator, bool> insert_leaf(node *leaf, bool owned = true){
+		node *found = to_node(cb_tree_get_or_insert(tree, leaf, nullptr));
+		if(found == leaf){
+			nkeys++;
+			return std::make_pair(iterator(tree, leaf), true);
+		}
+		if(owned) destroy(alloc, leaf);
+		if(!found) throw std::bad_alloc();
+		return std::make_pair(iterator(tree, found), false);
+	}
+
+	iterator bound(const Key &key, int strict){
+		uint8_t bytes[KEYLEN];
+		encode(key, bytes);
+		return iterator(tree, to_node(cb_tree_ceil(tree, bytes, strict, nullptr)));
+	}
+
+	// Frees the nodes below p. The branches, nibbles and initial leafs come from cb_tree.c's malloc().
+	void release(void *p){
+		int i;
+		if(!p || p == EMPTY) return;
+		if(((cb_branch*)p)->type != TYPE_LEAF){
+			for(i = 0; i < cb_nsons(p); i++)
+				release(cb_sons(p)[i]);
+			std::free(p);
+		}
+		else if(((cb_leaf*)p)->key[0] == TAG) destroy(alloc, static_cast<node*>((cb_leaf*)p));
+		else std::free(p);
+	}
+
+	cb_tree *tree;
+	node_alloc alloc;
+	std::atomic<std::size_t> nkeys;
+};
+
+#endif
@@ -1,6 +1,6 @@
 /*
  * Controlled test.
- * First inserts, then searches, and then removes.
+ * First inserts, then updates, then searches, then checks ordered queries while keys come and go, then removes keys by prefix, and then removes.
  */
 
 #include <stdlib.h>
@@ -10,6 +10,8 @@
 #include <sys/time.h>
 
 #include "cb_tree.h"
+#include "cb_traverse.h"
+#include "cb_shape.h"
 #include "almeidamacros.h"
 
 #define time_calc()\
@@ -24,6 +26,21 @@ do{\
 extern cb_tree* critbit;
 int nthreads;
 uint32_t nobjs;
+uint32_t wrong;		// failed checks, from every thread
+uint64_t upserted;	// sum of the values upserted into the shared key, and of the ones they replaced
+uint64_t replaced;
+
+// keys every thread updates at once
+char counter_key[KEYLEN] = "counter";
+char upsert_key[KEYLEN] = "upsert";
+
+// keys below and above all the others, which stay while the others are removed and inserted again
+char low_key[KEYLEN] = "!";
+char high_key[KEYLEN] = "~";
+volatile int churning;	// threads still removing and inserting
+volatile int *churned;	// object each churn thread is at
+
+#define PREFIXED 16	// objects under each son of the nibble node the prefix test builds
 
 void *thread_insert(void *index){
 	int tindex = *(int*)index;
@@ -36,12 +53,112 @@ void *thread_insert(void *index){
 		memset(leaf->key, 0, KEYLEN);
  //sprintf(leaf->key, "chave %d", i);
  		sprintf(leaf->key, "%d%d%d%d", i*4, i*2, i/2, i/4);
+		leaf->data = NULL;
 
 		cb_insert(leaf, &retries);
 	}
 	verbose("Insert thread #%d retried %d times.", tindex, retries);
 }
 
+// A leaf that isn't inserted because its key is already there is still the caller's.
+void *thread_update(void *index){
+	int tindex = *(int*)index;
+
+	uint32_t retries = 0;
+	cb_leaf *leaf, *found;
+	void *old, *data;
+	int i;
+	for(i = tindex*nobjs; i < (tindex+1)*nobjs; i++){
+		leaf = talloc(cb_leaf, 1);
+		memset(leaf->key, 0, KEYLEN);
+		sprintf(leaf->key, "%d%d%d%d", i*4, i*2, i/2, i/4);
+		found = cb_find(leaf->key, &retries);
+
+		// the key is there, so both return its leaf, and only the upsert moves the data
+		leaf->data = (void*)(uintptr_t)(i + 1);
+		if(cb_get_or_insert(leaf, &retries) != found || found->data != NULL)
+			atomic_inc(wrong);
+		if(cb_upsert(leaf, &old, &retries) != found || old != NULL || found->data != leaf->data)
+			atomic_inc(wrong);
+		if(cb_cas_data(leaf->key, leaf->data, NULL, &retries) == FAIL || cb_cas_data(leaf->key, leaf->data, NULL, &retries) == SUCCESS)
+			atomic_inc(wrong);
+		free(leaf);
+	}
+
+	// Every thread increments the shared counter with CAS, and upserts distinct values into the shared key.
+	// Each value must be replaced exactly once, except the last one.
+	uint64_t sum = 0, replaced_sum = 0;
+	for(i = 0; i < nobjs; i++){
+		do{
+			found = cb_find(counter_key, &retries);
+			data = found->data;
+		} while(cb_cas_data(counter_key, data, (void*)((uintptr_t)data + 1), &retries) == FAIL);
+
+		leaf = talloc(cb_leaf, 1);
+		memcpy(leaf->key, upsert_key, KEYLEN);
+		leaf->data = (void*)(uintptr_t)(tindex*nobjs + i + 1);
+		sum += tindex*nobjs + i + 1;
+		found = cb_upsert(leaf, &old, &retries);
+		replaced_sum += (uintptr_t)old;
+		if(found != leaf) free(leaf);
+	}
+	atomic_add(upserted, sum);
+	atomic_add(replaced, replaced_sum);
+	verbose("Update thread #%d retried %d times.", tindex, retries);
+}
+
+// removes every object and inserts it again
+void *thread_churn(void *index){
+	int tindex = *(int*)index;
+
+	uint32_t retries = 0;
+	cb_leaf *leaf;
+	int i;
+	for(i = tindex*nobjs; i < (tindex+1)*nobjs; i++){
+		churned[tindex] = i;
+		leaf = talloc(cb_leaf, 1);
+		memset(leaf->key, 0, KEYLEN);
+		sprintf(leaf->key, "%d%d%d%d", i*4, i*2, i/2, i/4);
+		leaf->data = NULL;
+		if(cb_remove(leaf->key, &retries) == FAIL || !cb_insert(leaf, &retries))
+			atomic_inc(wrong);
+	}
+	atomic_dec(churning);
+}
+
+// Meanwhile, the neighbors of the keys being removed and inserted must be on the right side of them, and the fences must stay the smallest and largest keys.
+void *thread_neighbor(void *index){
+	int tindex = *(int*)index;
+
+	uint32_t retries = 0;
+	cb_leaf *c, *f;
+	char key[KEYLEN];
+	int i, j;
+	while(churning){
+		for(j = 0; j < nthreads && churning; j++){
+			i = churned[j] + tindex % 2;
+			memset(key, 0, KEYLEN);
+			sprintf(key, "%d%d%d%d", i*4, i*2, i/2, i/4);
+			c = cb_ceil(key, &retries);
+			f = cb_floor(key, &retries);
+			if(!c || memcmp(c->key, key, KEYLEN) < 0 || memcmp(c->key, high_key, KEYLEN) > 0)
+				atomic_inc(wrong);
+			if(!f || memcmp(f->key, key, KEYLEN) > 0 || memcmp(f->key, low_key, KEYLEN) < 0)
+				atomic_inc(wrong);
+			if((c = cb_min(&retries)) == NULL || memcmp(c->key, low_key, KEYLEN))
+				atomic_inc(wrong);
+			if((c = cb_max(&retries)) == NULL || memcmp(c->key, high_key, KEYLEN))
+				atomic_inc(wrong);
+#ifdef COUNTS_ON
+			// Each churn thread has at most one object out, so there is always an i-th key below that many, and it is found despite the removals.
+			c = cb_select(i % (nthreads*nobjs - nthreads + 2), &retries);
+			if(!c || memcmp(c->key, low_key, KEYLEN) < 0 || memcmp(c->key, high_key, KEYLEN) > 0)
+				atomic_inc(wrong);
+#endif
+		}
+	}
+}
+
 void *thread_find(void *index){
 	int tindex = *(int*)index;
 
@@ -72,6 +189,78 @@ void *thread_remove(void *index){
 	verbose("Remove thread #%d retried %d times.", tindex, retries);
 }
 
+// Checks the shape statistics against the objects inserted and against each other. Returns the number of checks that failed.
+int check_shape(cb_shape *s, uint64_t n_objs){
+	uint64_t depths = 0, depth_sum = 0, nibbles = 0;
+	int i, n = 0;
+	for(i = 0; i <= MAX_DEPTH; i++){
+		depths += s->depth[i];
+		depth_sum += i*s->depth[i];
+		if(i > s->max_depth && s->depth[i]) n++;
+	}
+	for(i = 0; i <= 16; i++)
+		nibbles += s->nibble_sons[i];
+	if(s->leafs != n_objs + 2){
+		error("The shape has %lu leafs for %lu objects.", s->leafs, n_objs);
+		n++;
+	}
+	if(depths != s->leafs || depth_sum != s->depth_sum || !s->depth[s->max_depth]){
+		error("The leafs per depth don't add up.");
+		n++;
+	}
+	if(s->avg_depth*s->leafs < depth_sum - 0.5 || s->avg_depth*s->leafs > depth_sum + 0.5 || s->avg_depth > s->max_depth){
+		error("Average depth %.2f doesn't fit the leafs per depth.", s->avg_depth);
+		n++;
+	}
+	if(nibbles != s->nibbles || s->nibble_sons[0] || s->nibble_sons[1]){
+		error("%lu nibble nodes counted by number of sons instead of %lu.", nibbles, s->nibbles);
+		n++;
+	}
+	return n;
+}
+
+// counts the leafs of a subtree taken out of the tree
+uint64_t leafs(void *p){
+	uint64_t n = 0;
+	int i;
+	if(p == EMPTY) return 0;
+	if(((cb_branch*)p)->type == TYPE_LEAF) return 1;
+	for(i = 0; i < cb_nsons(p); i++)
+		n += leafs(cb_sons(p)[i]);
+	return n;
+}
+
+// Inserts the objects removed by prefix. Their second byte has every low nibble, so they hang from a nibble node, and each of its sons holds PREFIXED objects.
+void insert_prefixed(){
+	cb_leaf *leaf;
+	int i, j;
+	for(i = 0; i < 16; i++)
+		for(j = 0; j < PREFIXED; j++){
+			leaf = talloc(cb_leaf, 1);
+			memset(leaf->key, 0, KEYLEN);
+			sprintf(leaf->key, "p%c%d", 0x40 | i, j);
+			leaf->data = NULL;
+			cb_insert(leaf, NULL);
+		}
+}
+
+// counts the objects removed by prefix still in the tree, and those whose nibble is in [lo, hi) apart
+uint32_t prefixed(int lo, int hi, uint32_t *inside){
+	char key[KEYLEN];
+	uint32_t n = 0;
+	int i, j;
+	*inside = 0;
+	for(i = 0; i < 16; i++)
+		for(j = 0; j < PREFIXED; j++){
+			memset(key, 0, KEYLEN);
+			sprintf(key, "p%c%d", 0x40 | i, j);
+			if(!cb_find(key, NULL)) continue;
+			n++;
+			if(i >= lo && i < hi) (*inside)++;
+		}
+	return n;
+}
+
 int main(int argc, char **argv){
 	
 	if(argc < 3){
@@ -117,12 +306,62 @@ int main(int argc, char **argv){
 	gettimeofday(&tf, NULL);
 	verbose("All insert threads are done.");
 
-	uint64_t n_objs = cb_print(critbit->root);
+	uint64_t n_objs = cb_count(critbit->root, nthreads);
 	verbose("%ld object in the tree.", n_objs);
+#ifdef COUNTS_ON
+	uint8_t lo[KEYLEN], hi[KEYLEN];
+	memset(lo, 0, KEYLEN);
+	memset(hi, 0xFF, KEYLEN);
+	if(cb_range_count(lo, hi, NULL) != n_objs){
+		error("Leaf counts disagree with the traversal.");
+		return 1;
+	}
+#endif
+
+	cb_shape shape;
+	if(cb_shape_stats(critbit->root, nthreads, &shape) == FAIL){
+		error("Shape statistics failed.");
+		return 1;
+	}
+	cb_shape_print(&shape, stdout);
+	if(check_shape(&shape, n_objs))
+		return 1;
 
 	time_calc();
 	isecs = secs; imsecs = msecs; iusecs = usecs;
 
+/*
+ * UPDATING OBJECTS
+ */
+	cb_leaf *shared = talloc(cb_leaf, 2);
+	memcpy(shared[0].key, counter_key, KEYLEN);
+	shared[0].data = NULL;
+	memcpy(shared[1].key, upsert_key, KEYLEN);
+	shared[1].data = NULL;
+	cb_insert(&shared[0], NULL);
+	cb_insert(&shared[1], NULL);
+
+	for(i = 0; i < nthreads; i++){
+		if(pthread_create(&threads[i], NULL, &thread_update, &thread_index[i]))
+			error("Creation of update thread #%d failed.", i);
+	}
+	for(i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	verbose("All update threads are done.");
+
+	uint64_t counter = (uintptr_t)cb_find(counter_key, NULL)->data;
+	uint64_t last = (uintptr_t)cb_find(upsert_key, NULL)->data;
+	if(wrong)
+		error("%d updates of single objects went wrong.", wrong);
+	if(counter != (uint64_t)nthreads*nobjs)
+		error("The counter reached %lu instead of %lu.", counter, (uint64_t)nthreads*nobjs);
+	if(replaced + last != upserted)
+		error("Upserted values were lost or replaced twice.");
+	if(wrong || counter != (uint64_t)nthreads*nobjs || replaced + last != upserted)
+		return 1;
+	cb_remove(counter_key, NULL);
+	cb_remove(upsert_key, NULL);
+
 /*
  * FINDING OBJECTS
  */
@@ -138,12 +377,124 @@ int main(int argc, char **argv){
 	gettimeofday(&tf, NULL);
 	verbose("All find threads are done.");
 
-	n_objs = cb_print(critbit->root);
+	n_objs = cb_count(critbit->root, nthreads);
 	verbose("%ld objects in the tree.", n_objs);
 
 	time_calc();
 	fsecs = secs; fmsecs = msecs; fusecs = usecs;
 
+/*
+ * ORDERED QUERIES
+ */
+	// walks the keys up and down, one neighbor at a time
+	uint64_t up = 0, down = 0;
+	cb_leaf *prev = NULL, *l;
+	for(l = cb_min(NULL); l; prev = l, l = cb_tree_ceil(critbit, l->key, 1, NULL), up++)
+		if(prev && memcmp(prev->key, l->key, KEYLEN) >= 0) wrong++;
+	if(prev != cb_max(NULL)) wrong++;
+	for(prev = NULL, l = cb_max(NULL); l; prev = l, l = cb_tree_floor(critbit, l->key, 1, NULL), down++)
+		if(prev && memcmp(prev->key, l->key, KEYLEN) <= 0) wrong++;
+	if(prev != cb_min(NULL)) wrong++;
+	if(up != n_objs || down != n_objs)
+		error("Ordered walks found %lu and %lu objects.", up, down);
+#ifdef COUNTS_ON
+	// the k-th key has k keys below it
+	for(i = 0; i < n_objs; i += n_objs/64 + 1)
+		if(!(l = cb_select(i, NULL)) || cb_rank(l->key, NULL) != i) wrong++;
+	if(cb_select(n_objs, NULL)) wrong++;
+#endif
+
+	cb_leaf *fences = talloc(cb_leaf, 2);
+	memcpy(fences[0].key, low_key, KEYLEN);
+	memcpy(fences[1].key, high_key, KEYLEN);
+	cb_insert(&fences[0], NULL);
+	cb_insert(&fences[1], NULL);
+	churning = nthreads;
+	churned = talloc(int, nthreads);
+	for(i = 0; i < nthreads; i++)
+		churned[i] = i*nobjs;
+	pthread_t *neighbors = talloc(pthread_t, nthreads);
+	for(i = 0; i < nthreads; i++){
+		if(pthread_create(&threads[i], NULL, &thread_churn, &thread_index[i]) || pthread_create(&neighbors[i], NULL, &thread_neighbor, &thread_index[i]))
+			error("Creation of churn thread #%d failed.", i);
+	}
+	for(i = 0; i < nthreads; i++){
+		pthread_join(threads[i], NULL);
+		pthread_join(neighbors[i], NULL);
+	}
+	cb_remove(low_key, NULL);
+	cb_remove(high_key, NULL);
+	free(neighbors);
+	free((int*)churned);
+	verbose("Ordered queries checked while objects were removed and inserted again.");
+	if(wrong || up != n_objs || down != n_objs){
+		error("%d ordered queries went wrong.", wrong);
+		return 1;
+	}
+
+/*
+ * REMOVING BY PREFIX
+ */
+	char prefix[KEYLEN];
+	void *subtree;
+	uint32_t left, inside;
+	insert_prefixed();
+
+	// The prefix ends 2 bits into the nibble node, so the 4 sons matching it are handed out under a new nibble node.
+	memset(prefix, 0, KEYLEN);
+	prefix[0] = 'p';
+	prefix[1] = 0x44;
+	if(cb_remove_prefix(prefix, 14, &subtree, NULL) == FAIL || ((cb_branch*)subtree)->type != TYPE_NIBBLE || leafs(subtree) != 4*PREFIXED){
+		error("Removal of a prefix ending inside a nibble node failed.");
+		wrong++;
+	}
+	else if((left = prefixed(4, 8, &inside)) != 12*PREFIXED || inside){
+		error("%d objects were left after removing a prefix ending inside a nibble node.", left);
+		wrong++;
+	}
+	else
+		verbose("Prefix ending inside a nibble node removed.");
+
+	// every object left starts with "p", so they go in a single subtree, and the same prefix finds none anymore
+	prefix[1] = 0;
+	if(cb_remove_prefix(prefix, 8, &subtree, NULL) == FAIL || leafs(subtree) != 12*PREFIXED || prefixed(0, 16, &inside)){
+		error("Removal of a whole subtree by prefix failed.");
+		wrong++;
+	}
+	else if(cb_remove_prefix(prefix, 8, &subtree, NULL) != FAIL){
+		error("A prefix was removed twice.");
+		wrong++;
+	}
+	else
+		verbose("Whole subtree removed by prefix.");
+
+	// the initial leafs' keys start with every prefix of all zeros but for the first bit, so none of them is removed, not even the empty prefix
+	memset(prefix, 0, KEYLEN);
+	for(i = 0; i <= KEYLEN*8; i += i < 16 ? 1 : 16){
+		prefix[0] = 0;
+		if(cb_remove_prefix(prefix, i, &subtree, NULL) != FAIL){
+			error("Prefix of the initial leaf removed, %d bits long.", i);
+			wrong++;
+		}
+		prefix[0] = 0x80;
+		if(cb_remove_prefix(prefix, i, &subtree, NULL) != FAIL){
+			error("Prefix of the initial leaf in the middle removed, %d bits long.", i);
+			wrong++;
+		}
+	}
+	if(cb_count(critbit->root, nthreads) != n_objs){
+		error("Removals by prefix took objects that weren't theirs.");
+		wrong++;
+	}
+#ifdef COUNTS_ON
+	if(cb_range_count(lo, hi, NULL) != n_objs){
+		error("Leaf counts disagree with the traversal after removals by prefix.");
+		wrong++;
+	}
+#endif
+	if(wrong)
+		return 1;
+
 /*
  * REMOVING OBJECT
  */
@@ -159,7 +510,7 @@ int main(int argc, char **argv){
 	gettimeofday(&tf, NULL);
 	verbose("All remove threads are done.");
 
-	n_objs = cb_print(critbit->root);
+	n_objs = cb_count(critbit->root, nthreads);
 	verbose("%ld objects in the tree.", n_objs);
 	
 	time_calc();
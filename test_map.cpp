@@ -0,0 +1,143 @@
+/*
+ * Typed map test.
+ * Threads insert into a critbit_map, and then its lookups, order and node handles are checked.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "critbit_map.hpp"
+#include "almeidamacros.h"
+
+typedef critbit_map<int64_t, uint64_t> map_type;
+
+map_type *map;
+int nthreads;
+int64_t nobjs;
+uint32_t wrong;		// failed checks, from every thread
+
+// keys are spread around 0, so negative ones are inserted too
+static int64_t key_of(int64_t i){
+	return (i % 2 ? -i : i) * 7919;
+}
+
+void *thread_insert(void *index){
+	int tindex = *(int*)index;
+	int64_t i;
+	for(i = tindex*nobjs; i < (tindex+1)*nobjs; i++)
+		if(!map->insert(key_of(i), (uint64_t)i).second){
+			error("Key %ld inserted twice.", key_of(i));
+			atomic_inc(wrong);
+		}
+	return NULL;
+}
+
+void *thread_find(void *index){
+	int tindex = *(int*)index;
+	int64_t i;
+	int found = 0;
+	for(i = tindex*nobjs; i < (tindex+1)*nobjs; i++){
+		map_type::iterator it = map->find(key_of(i));
+		if(it != map->end() && *it == (uint64_t)i) found++;
+	}
+	verbose("Find thread #%d found %d objects.", tindex, found);
+	if(found != nobjs){
+		error("Find thread #%d missed %ld objects.", tindex, nobjs - found);
+		atomic_inc(wrong);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv){
+
+	if(argc < 3){
+		verbose("Usage: ./test_map #threads #objects");
+		return 1;
+	}
+
+	nthreads = atoi(argv[1]);
+	nobjs = atoi(argv[2]);
+
+	cb_init();
+	map = new map_type();
+
+	pthread_t *threads = talloc(pthread_t, nthreads);
+	int *thread_index = talloc(int, nthreads);
+	int i;
+
+	for(i = 0; i < nthreads; i++){
+		thread_index[i] = i;
+		if(pthread_create(&threads[i], NULL, &thread_insert, &thread_index[i])){
+			error("Creation of insert thread #%d failed.", i);
+			return 1;
+		}
+	}
+	for(i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	verbose("%lu objects in the map.", (unsigned long)map->size());
+
+	for(i = 0; i < nthreads; i++){
+		if(pthread_create(&threads[i], NULL, &thread_find, &thread_index[i])){
+			error("Creation of find thread #%d failed.", i);
+			return 1;
+		}
+	}
+	for(i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	// the iteration must see every key once, in order
+	uint64_t n = 0;
+	int64_t last = 0;
+	for(map_type::iterator it = map->begin(); it != map->end(); ++it, n++){
+		if(n && it.key() <= last){
+			error("Key %ld after %ld.", it.key(), last);
+			wrong++;
+		}
+		last = it.key();
+	}
+	if(n != map->size() || n != (uint64_t)(nthreads*nobjs)){
+		error("Iteration saw %lu objects.", (unsigned long)n);
+		wrong++;
+	}
+
+	// moves every other object out and back in through its node handle
+	int64_t moved = 0;
+	for(int64_t j = 0; j < nthreads*nobjs; j += 2){
+		map_type::node_type nh = map->extract(key_of(j));
+		if(!nh || nh.value() != (uint64_t)j){
+			error("Extraction of key %ld failed.", key_of(j));
+			wrong++;
+			continue;
+		}
+		nh.value() = j + 1;
+		if(!map->insert(std::move(nh)).second || !nh.empty()){
+			error("Reinsertion of key %ld failed.", key_of(j));
+			wrong++;
+		}
+		moved++;
+	}
+	verbose("%ld objects moved through node handles.", moved);
+
+	for(int64_t j = 0; j < nthreads*nobjs; j++)
+		if(!map->erase(key_of(j))){
+			error("Removal of key %ld failed.", key_of(j));
+			wrong++;
+		}
+	verbose("%lu objects in the map.", (unsigned long)map->size());
+	if(map->begin() != map->end() || map->size()){
+		error("Iteration of the empty map found a key.");
+		wrong++;
+	}
+
+	delete map;
+	free(threads);
+	free(thread_index);
+	if(wrong){
+		error("%d checks of the map went wrong.", wrong);
+		return 1;
+	}
+	verbose("All checks of the map passed.");
+	return 0;
+}
@@ -0,0 +1,299 @@
+/*
+ * Split and merge test.
+ * Splits the tree at several keys, checks that every object lands on its side, and merges the halves back. Then splits once more while objects are inserted.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cb_tree.h"
+#include "cb_traverse.h"
+#include "almeidamacros.h"
+
+#define SPLIT_KEYS 5	// keys the tree is split at, one round each
+
+extern cb_tree* critbit;
+int nthreads;
+uint32_t nobjs;
+uint32_t wrong;		// failed checks, from every thread
+
+cb_tree *upper;			// the tree split off, with the keys from split_key on
+uint8_t split_key[KEYLEN];
+int stride;			// insert threads take every stride-th object, from the first one of the thread plus offset
+int offset;
+int concurrent;			// the odd objects were inserted while the tree was split
+
+static void object_key(uint8_t *key, int i){
+	memset(key, 0, KEYLEN);
+	sprintf((char*)key, "%d%d%d%d", i*4, i*2, i/2, i/4);
+}
+
+void *thread_insert(void *index){
+	int tindex = *(int*)index;
+
+	uint32_t retries = 0;
+	cb_leaf *leaf;
+	int i;
+	for(i = tindex*nobjs + offset; i < (tindex+1)*nobjs; i += stride){
+		leaf = talloc(cb_leaf, 1);
+		object_key(leaf->key, i);
+		leaf->data = NULL;
+		if(!cb_insert(leaf, &retries))
+			error("Insert of object %d at thread #%d failed.", i, tindex);
+	}
+}
+
+void *thread_remove(void *index){
+	int tindex = *(int*)index;
+
+	uint32_t retries = 0;
+	uint8_t key[KEYLEN];
+	int i;
+	for(i = tindex*nobjs + offset; i < (tindex+1)*nobjs; i += stride){
+		object_key(key, i);
+		if(cb_remove(key, &retries) == FAIL)
+			error("Remove of object %d at thread #%d failed.", i, tindex);
+	}
+}
+
+// Every object must be in the tree of its side of split_key, and only there. The ones inserted during the split may be in either, but only in one.
+void *thread_partition(void *index){
+	int tindex = *(int*)index;
+
+	uint8_t key[KEYLEN];
+	cb_leaf *low, *high;
+	int i;
+	for(i = tindex*nobjs; i < (tindex+1)*nobjs; i++){
+		object_key(key, i);
+		low = cb_tree_find(critbit, key, NULL);
+		high = cb_tree_find(upper, key, NULL);
+		if(concurrent && i % 2 && memcmp(key, split_key, KEYLEN) >= 0 ? !low == !high : (memcmp(key, split_key, KEYLEN) < 0 ? !low || high : low || !high))
+			atomic_inc(wrong);
+	}
+}
+
+// after the merge, every object is back in the tree
+void *thread_merged(void *index){
+	int tindex = *(int*)index;
+
+	uint8_t key[KEYLEN];
+	int i;
+	for(i = tindex*nobjs; i < (tindex+1)*nobjs; i++){
+		object_key(key, i);
+		if(!cb_tree_find(critbit, key, NULL) || cb_tree_find(upper, key, NULL))
+			atomic_inc(wrong);
+	}
+}
+
+void run(void *(*function)(void*), pthread_t *threads, int *thread_index){
+	int i;
+	for(i = 0; i < nthreads; i++){
+		thread_index[i] = i;
+		if(pthread_create(&threads[i], NULL, function, &thread_index[i]))
+			error("Creation of thread #%d failed.", i);
+	}
+	for(i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+// Checks both halves of a split, with the traversal and, with counts, with the leaf counts. Returns the number of objects below split_key.
+int check_partition(pthread_t *threads, int *thread_index, uint64_t n_objs){
+	uint8_t key[KEYLEN];
+	uint64_t below = 0, n_low, n_high;
+	int i;
+
+	run(&thread_partition, threads, thread_index);
+	for(i = 0; i < nthreads*nobjs; i++){
+		object_key(key, i);
+		if(memcmp(key, split_key, KEYLEN) < 0) below++;
+	}
+	n_low = cb_count(critbit->root, nthreads);
+	n_high = cb_count(upper->root, nthreads);
+	if(n_low != below || n_high != n_objs - below){
+		error("The halves hold %lu and %lu objects instead of %lu and %lu.", n_low, n_high, below, n_objs - below);
+		wrong++;
+	}
+#ifdef COUNTS_ON
+	uint8_t lo[KEYLEN], hi[KEYLEN];
+	memset(lo, 0, KEYLEN);
+	memset(hi, 0xFF, KEYLEN);
+	if(cb_tree_range_count(critbit, lo, hi, NULL) != n_low || cb_tree_range_count(upper, lo, hi, NULL) != n_high){
+		error("Leaf counts disagree with the traversal after the split.");
+		wrong++;
+	}
+#endif
+	return below;
+}
+
+// merges the halves back and checks every object is in the tree again
+int check_merge(pthread_t *threads, int *thread_index, uint64_t n_objs){
+	if(cb_merge(critbit, upper, NULL) == FAIL){
+		error("Merge failed.");
+		return FAIL;
+	}
+	run(&thread_merged, threads, thread_index);
+	if(cb_count(critbit->root, nthreads) != n_objs || cb_count(upper->root, nthreads) != 0){
+		error("The merged tree holds %lu objects instead of %lu.", cb_count(critbit->root, nthreads), n_objs);
+		wrong++;
+	}
+#ifdef COUNTS_ON
+	uint8_t lo[KEYLEN], hi[KEYLEN];
+	memset(lo, 0, KEYLEN);
+	memset(hi, 0xFF, KEYLEN);
+	if(cb_tree_range_count(critbit, lo, hi, NULL) != n_objs){
+		error("Leaf counts disagree with the traversal after the merge.");
+		wrong++;
+	}
+#endif
+	return wrong ? FAIL : SUCCESS;
+}
+
+int main(int argc, char **argv){
+
+	if(argc < 3){
+		verbose("Usage: ./test_split #threads #objects");
+		return 1;
+	}
+
+	nthreads = atoi(argv[1]);
+	nobjs = atoi(argv[2]);
+
+	cb_init();
+
+	pthread_t *threads = talloc(pthread_t, nthreads);
+	int *thread_index = talloc(int, nthreads);
+	int i, below;
+
+/*
+ * INSERTING OBJECTS
+ */
+	verbose("%d threads inserting %d objects each:", nthreads, nobjs);
+	stride = 1;
+	offset = 0;
+	run(&thread_insert, threads, thread_index);
+	uint64_t n_objs = cb_count(critbit->root, nthreads);
+	verbose("%lu objects in the tree.", n_objs);
+
+/*
+ * SPLITTING AND MERGING
+ */
+	// a key in the tree, one between two keys, a prefix of many keys, and the initial leafs' keys, which move everything or nothing
+	for(i = 0; i < SPLIT_KEYS; i++){
+		object_key(split_key, nthreads*nobjs/2);
+		if(i == 1) split_key[strlen((char*)split_key)] = '!';
+		if(i == 2){
+			memset(split_key, 0, KEYLEN);
+			split_key[0] = '5';
+		}
+		if(i == 3) memset(split_key, 0, KEYLEN);
+		if(i == 4) split_key[0] = 0x80;
+
+		if(!(upper = cb_split(critbit, split_key, NULL))){
+			error("Split #%d failed.", i);
+			return 1;
+		}
+		below = check_partition(threads, thread_index, n_objs);
+		if(wrong){
+			error("Split #%d put %d objects on the wrong side.", i, wrong);
+			return 1;
+		}
+		if(check_merge(threads, thread_index, n_objs) == FAIL)
+			return 1;
+		verbose("Split #%d left %d objects below and moved %lu, and the merge brought them back.", i, below, n_objs - below);
+	}
+
+/*
+ * SPLITTING WHILE INSERTING
+ */
+	// the odd objects are inserted again while the tree is split at the middle object
+	stride = 2;
+	offset = 1;
+	run(&thread_remove, threads, thread_index);
+	object_key(split_key, nthreads*nobjs/2);
+	concurrent = 1;
+	for(i = 0; i < nthreads; i++){
+		thread_index[i] = i;
+		if(pthread_create(&threads[i], NULL, &thread_insert, &thread_index[i]))
+			error("Creation of insert thread #%d failed.", i);
+	}
+	// splits once the first thread is halfway
+	uint8_t key[KEYLEN];
+	object_key(key, (nobjs/2) | 1);
+	while(nobjs > 1 && !cb_find(key, NULL));
+	upper = cb_split(critbit, split_key, NULL);
+	for(i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	if(!upper){
+		error("Split while inserting failed.");
+		return 1;
+	}
+	run(&thread_partition, threads, thread_index);
+	if(wrong){
+		error("Split while inserting misplaced %d objects.", wrong);
+		return 1;
+	}
+
+	// Insertions that came after the split left objects from split_key on in the tree. They move by hand before the merge.
+	cb_leaf *leaf;
+	uint32_t moved = 0;
+	for(i = 1; i < nthreads*nobjs; i += 2){
+		object_key(key, i);
+		if(memcmp(key, split_key, KEYLEN) < 0 || !(leaf = cb_tree_take(critbit, key, NULL))) continue;
+		if(!cb_tree_insert(upper, leaf, NULL)){
+			error("Object %d couldn't move to the split tree.", i);
+			return 1;
+		}
+		moved++;
+	}
+	concurrent = 0;
+	below = check_partition(threads, thread_index, n_objs);
+	if(wrong){
+		error("Split while inserting put %d objects on the wrong side.", wrong);
+		return 1;
+	}
+	if(check_merge(threads, thread_index, n_objs) == FAIL)
+		return 1;
+	verbose("Split while inserting left %d objects below, %u of them inserted after the split, and the merge brought them back.", below, moved);
+
+/*
+ * MERGING INTO A NIBBLE NODE
+ */
+	// b's keys fall between a's in the nibble node testing the second byte's first 4 bits, 0x9 into an empty son and 0xB into a taken one
+	uint8_t a_bytes[] = {0x00, 0x20, 0x40, 0x60, 0x80, 0xB8, 0xC0, 0xE0}, b_bytes[] = {0x98, 0xB0};
+	cb_tree *a = cb_new(), *b = cb_new();
+	if(!a || !b){
+		error("Creation of the trees to merge failed.");
+		return 1;
+	}
+	for(i = 0; i < 10; i++){
+		leaf = talloc(cb_leaf, 1);
+		memset(leaf->key, 0, KEYLEN);
+		leaf->key[0] = 0x10;
+		leaf->key[1] = i < 8 ? a_bytes[i] : b_bytes[i - 8];
+		leaf->data = NULL;
+		if(!cb_tree_insert(i < 8 ? a : b, leaf, NULL))
+			error("Insert of key #%d to merge failed.", i);
+	}
+	if(cb_merge(a, b, NULL) == FAIL){
+		error("Merge into a nibble node failed.");
+		return 1;
+	}
+	for(i = 0; i < 10; i++){
+		memset(key, 0, KEYLEN);
+		key[0] = 0x10;
+		key[1] = i < 8 ? a_bytes[i] : b_bytes[i - 8];
+		if(!cb_tree_find(a, key, NULL) || cb_tree_find(b, key, NULL))
+			wrong++;
+	}
+	if(wrong || cb_count(a->root, 1) != 10 || cb_count(b->root, 1) != 0){
+		error("Merge into a nibble node misplaced %d keys.", wrong);
+		return 1;
+	}
+	verbose("Merge into a nibble node hung b's keys in a.");
+
+	free(threads);
+	free(thread_index);
+	return 0;
+}
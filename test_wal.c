@@ -0,0 +1,260 @@
+/*
+ * Write-ahead log test.
+ * Durably inserts and removes objects, takes checkpoints, also while the tree changes, and then recovers the tree from the log.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "cb_tree.h"
+#include "cb_wal.h"
+#include "almeidamacros.h"
+
+#define time_calc()\
+do{\
+	secs = (tf.tv_sec - ti.tv_sec);\
+	msecs = (tf.tv_usec - ti.tv_usec)/1000;\
+	usecs = (tf.tv_usec - ti.tv_usec)%1000;\
+	if(msecs < 0){secs--; msecs += 1000;}\
+	if(usecs < 0){msecs--; usecs += 1000;}\
+} while(0)
+
+#define CHECKPOINT_ROUNDS 10	// checkpoints taken while the tree changes, each followed by a recovery
+
+extern cb_tree* critbit;
+int nthreads;
+uint32_t nobjs;
+volatile int stop;	// ends the churn threads
+
+size_t data_size(void *data){
+	return sizeof(int);
+}
+
+void *thread_insert(void *index){
+	int tindex = *(int*)index;
+
+	uint32_t retries = 0;
+	cb_leaf *leaf;
+	int i;
+	for(i = tindex*nobjs; i < (tindex+1)*nobjs; i++){
+		leaf = talloc(cb_leaf, 1);
+		memset(leaf->key, 0, KEYLEN);
+ 		sprintf(leaf->key, "%d%d%d%d", i*4, i*2, i/2, i/4);
+		leaf->data = talloc(int, 1);
+		*(int*)leaf->data = i;
+
+		if(!cb_wal_insert(leaf, &retries))
+			error("Insert of object %d at thread #%d failed.", i, tindex);
+	}
+	verbose("Insert thread #%d retried %d times.", tindex, retries);
+}
+
+void *thread_remove(void *index){
+	int tindex = *(int*)index;
+
+	uint32_t retries = 0;
+	int i;
+	char key[KEYLEN];
+	// removes every odd object
+	for(i = tindex*nobjs + 1; i < (tindex+1)*nobjs; i += 2){
+		memset(key, 0, KEYLEN);
+		sprintf(key, "%d%d%d%d", i*4, i*2, i/2, i/4);
+		if(cb_wal_remove(key, &retries) == FAIL)
+			error("Remove of object %d at thread #%d failed.", i, tindex);
+	}
+	verbose("Remove thread #%d retried %d times.", tindex, retries);
+}
+
+// Removes and inserts again the odd objects until stopped, so that the tree changes shape under a checkpoint.
+// These changes aren't logged, to make them fast. A checkpoint may then miss an odd object, which restore() inserts again.
+void *thread_churn(void *index){
+	int tindex = *(int*)index;
+
+	uint32_t retries = 0;
+	cb_leaf *leaf;
+	int i;
+	char key[KEYLEN];
+	while(!stop){
+		for(i = tindex*nobjs + 1; i < (tindex+1)*nobjs && !stop; i += 2){
+			memset(key, 0, KEYLEN);
+			sprintf(key, "%d%d%d%d", i*4, i*2, i/2, i/4);
+			cb_remove(key, &retries);
+
+			leaf = talloc(cb_leaf, 1);
+			memcpy(leaf->key, key, KEYLEN);
+			leaf->data = talloc(int, 1);
+			*(int*)leaf->data = i;
+			if(!cb_insert(leaf, &retries)){
+				free(leaf->data);
+				free(leaf);
+			}
+		}
+	}
+}
+
+// durably inserts again the odd objects a recovery didn't bring back
+void restore(){
+	cb_leaf *leaf;
+	int i;
+	char key[KEYLEN];
+	for(i = 1; i < nthreads*nobjs; i += 2){
+		memset(key, 0, KEYLEN);
+		sprintf(key, "%d%d%d%d", i*4, i*2, i/2, i/4);
+		if(cb_find(key, NULL)) continue;
+		leaf = talloc(cb_leaf, 1);
+		memcpy(leaf->key, key, KEYLEN);
+		leaf->data = talloc(int, 1);
+		*(int*)leaf->data = i;
+		if(!cb_wal_insert(leaf, NULL))
+			error("Insert of object %d failed.", i);
+	}
+}
+
+// counts the even objects, which no thread removes, missing from the tree
+int missing(){
+	int i, n = 0;
+	char key[KEYLEN];
+	cb_leaf *leaf;
+	for(i = 0; i < nthreads*nobjs; i += 2){
+		memset(key, 0, KEYLEN);
+		sprintf(key, "%d%d%d%d", i*4, i*2, i/2, i/4);
+		leaf = cb_find(key, NULL);
+		if(!leaf || *(int*)leaf->data != i) n++;
+	}
+	return n;
+}
+
+void run(void *(*function)(void*), pthread_t *threads, int *thread_index){
+	int i;
+	for(i = 0; i < nthreads; i++){
+		thread_index[i] = i;
+		if(pthread_create(&threads[i], NULL, function, &thread_index[i]))
+			error("Creation of thread #%d failed.", i);
+	}
+	for(i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+int main(int argc, char **argv){
+
+	if(argc < 4){
+		verbose("Usage: ./test_wal #threads #objects log_path");
+		return 1;
+	}
+
+	nthreads = atoi(argv[1]);
+	nobjs = atoi(argv[2]);
+	char *path = argv[3];
+	char file[4096];
+	snprintf(file, sizeof(file), "%s.log", path); unlink(file);
+	snprintf(file, sizeof(file), "%s.log.old", path); unlink(file);
+	snprintf(file, sizeof(file), "%s.ckpt", path); unlink(file);
+
+	cb_init();
+	if(cb_wal_open(path, &data_size) == FAIL){
+		error("Could not open the log at %s.", path);
+		return 1;
+	}
+
+	pthread_t *threads = talloc(pthread_t, nthreads);
+	int *thread_index = talloc(int, nthreads);
+
+	struct timeval ti, tf;
+	long int secs, msecs, usecs;
+
+/*
+ * INSERTING AND REMOVING OBJECTS
+ */
+	verbose("%d threads durably inserting %d objects each:", nthreads, nobjs);
+	gettimeofday(&ti, NULL);
+	run(&thread_insert, threads, thread_index);
+	gettimeofday(&tf, NULL);
+	time_calc();
+	verbose("insertion-time: %ld.%ld%ld", secs, msecs, usecs);
+
+	if(cb_wal_checkpoint() == FAIL){
+		error("Checkpoint failed.");
+		return 1;
+	}
+	verbose("Checkpoint taken.");
+
+	// A checkpoint taken while the tree changes must still hold every object no one touched. Each one is checked by recovering from it.
+	int i, round, lost;
+	for(round = 0; round < CHECKPOINT_ROUNDS; round++){
+		stop = 0;
+		for(i = 0; i < nthreads; i++){
+			thread_index[i] = i;
+			if(pthread_create(&threads[i], NULL, &thread_churn, &thread_index[i]))
+				error("Creation of thread #%d failed.", i);
+		}
+		usleep(10000);
+		if(cb_wal_checkpoint() == FAIL){
+			error("Checkpoint failed.");
+			return 1;
+		}
+		stop = 1;
+		for(i = 0; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+
+		cb_wal_close();
+		cb_init();
+		if(cb_wal_open(path, &data_size) == FAIL){
+			error("Recovery failed.");
+			return 1;
+		}
+		if((lost = missing())){
+			error("Checkpoint #%d lost %d objects.", round, lost);
+			return 1;
+		}
+		restore();
+	}
+	verbose("%d checkpoints taken while objects were removed and inserted.", CHECKPOINT_ROUNDS);
+
+	gettimeofday(&ti, NULL);
+	run(&thread_remove, threads, thread_index);
+	gettimeofday(&tf, NULL);
+	time_calc();
+	verbose("removing-time: %ld.%ld%ld", secs, msecs, usecs);
+
+	uint64_t n_objs = cb_print(critbit->root);
+	verbose("%ld objects in the tree.", n_objs);
+	cb_wal_close();
+
+/*
+ * RECOVERING
+ */
+	cb_init();
+	gettimeofday(&ti, NULL);
+	if(cb_wal_open(path, &data_size) == FAIL){
+		error("Recovery failed.");
+		return 1;
+	}
+	gettimeofday(&tf, NULL);
+	time_calc();
+	verbose("recovery-time: %ld.%ld%ld", secs, msecs, usecs);
+
+	uint64_t n_recovered = cb_print(critbit->root);
+	verbose("%ld objects recovered.", n_recovered);
+
+	int wrong = 0;
+	char key[KEYLEN];
+	cb_leaf *leaf;
+	for(i = 0; i < nthreads*nobjs; i++){
+		memset(key, 0, KEYLEN);
+		sprintf(key, "%d%d%d%d", i*4, i*2, i/2, i/4);
+		leaf = cb_find(key, NULL);
+		if((i % 2) ? leaf != NULL : (!leaf || *(int*)leaf->data != i)) wrong++;
+	}
+	cb_wal_close();
+
+	if(wrong || n_recovered != n_objs){
+		error("%d objects recovered wrongly.", wrong);
+		return 1;
+	}
+	verbose("All objects recovered correctly.");
+	return 0;
+}